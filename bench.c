@@ -0,0 +1,727 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ * copyright 2025-2026 mannikim <mannikim[at]proton[dot]me>
+ * this file is part of pie
+ * see LICENSE file for the license text
+
+piebench: checks & benchmarks for pie's farbfeld codec & pixel kernels. results
+are tab separated: kernel, image width & height, ns per pixel & GB/s */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+struct ColorRGBA {
+	unsigned char r, g, b, a;
+};
+
+struct Vec2i {
+	int x, y;
+};
+
+#include "ff.h"
+#include "img.h"
+
+/* decoding below this throughput (MB/s of farbfeld data) is reported. only
+ * the correctness checks fail the run, timings vary with the machine */
+#define TARGET_DECODE_MBS 1000
+
+/* images go from 32x32 up to this size, 4 times larger each step */
+#define BENCH_MAX_SIZE 16384
+/* samples kept per kernel, after one warmup sample */
+#define BENCH_REPS 5
+/* shortest sample & longest time spent sampling one kernel, in seconds */
+#define BENCH_SAMPLE_TIME 0.01
+#define BENCH_TIME 2.0
+/* sampleImg calls per run */
+#define BENCH_SAMPLES 65536
+/* canvas size for comparing stamped & span strokes */
+#define BENCH_STROKE_SIZE 2048
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static bool
+checkDecode(void)
+{
+	unsigned char *in = malloc(65536 * 2);
+	unsigned char *out = malloc(65536);
+	if (in == NULL || out == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+
+	for (size_t i = 0; i < 65536; i++)
+	{
+		in[i * 2] = (unsigned char)(i >> 8);
+		in[i * 2 + 1] = (unsigned char)i;
+	}
+
+	bool ok = true;
+	/* odd offsets and lengths exercise the scalar tail */
+	for (size_t off = 0; off < 3 && ok; off++)
+	{
+		ffDecode(in + off * 2, out, 65536 - off * 7);
+		for (size_t i = 0; i < 65536 - off * 7; i++)
+			if (out[i] != (i + off) / 257)
+			{
+				fprintf(stderr,
+					"ffDecode: sample %zu decoded to %u\n",
+					i + off,
+					out[i]);
+				ok = false;
+				break;
+			}
+	}
+
+	free(in);
+	free(out);
+	return ok;
+}
+
+static bool
+checkEncode(void)
+{
+	unsigned char in[256 + 7], out[(256 + 7) * 2];
+	for (size_t i = 0; i < sizeof in; i++)
+		in[i] = (unsigned char)i;
+
+	ffEncode(in, out, sizeof in);
+	for (size_t i = 0; i < sizeof in; i++)
+	{
+		unsigned int x = (unsigned int)out[i * 2] << 8 | out[i * 2 + 1];
+		if (x != in[i] * 257u)
+		{
+			fprintf(stderr,
+				"ffEncode: %u encoded to %u\n",
+				in[i],
+				x);
+			return false;
+		}
+	}
+	return true;
+}
+
+static struct ColorRGBA
+randColor(uint32_t *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	uint32_t x = *seed;
+	*seed = *seed * 1103515245 + 12345;
+	struct ColorRGBA c = {(unsigned char)(x >> 8),
+			      (unsigned char)(x >> 16),
+			      (unsigned char)(x >> 24),
+			      (unsigned char)(*seed >> 16)};
+	/* make the fast paths common */
+	switch (*seed >> 28)
+	{
+	case 0:
+	case 1:
+	case 2:
+		c.a = 0;
+		break;
+	case 3:
+	case 4:
+		c.a = 0xff;
+		break;
+	}
+	return c;
+}
+
+static bool
+checkBlend(void)
+{
+	for (unsigned int x = 0; x <= 0xff * 0xff; x++)
+		if (mtDiv255(x) != (x + 127) / 255)
+		{
+			fprintf(stderr, "mtDiv255: %u is wrong\n", x);
+			return false;
+		}
+
+	enum { N = 4096 + 7 };
+	static struct ColorRGBA src[N], dst[N], ref[N];
+	uint32_t seed = 7;
+	for (int round = 0; round < 64; round++)
+	{
+		for (size_t i = 0; i < N; i++)
+		{
+			src[i] = randColor(&seed);
+			dst[i] = randColor(&seed);
+			/* opaque destinations take the simd path */
+			if (round % 2 == 0)
+				dst[i].a = 0xff;
+			ref[i] = mtBlend(src[i], dst[i]);
+		}
+
+		blendRow(dst, src, N);
+		if (memcmp(dst, ref, sizeof dst) == 0)
+			continue;
+
+		for (size_t i = 0; i < N; i++)
+			if (memcmp(&dst[i], &ref[i], sizeof dst[i]) != 0)
+			{
+				fprintf(stderr,
+					"blendRow: pixel %zu is "
+					"%02x%02x%02x%02x, expected "
+					"%02x%02x%02x%02x\n",
+					i,
+					dst[i].r,
+					dst[i].g,
+					dst[i].b,
+					dst[i].a,
+					ref[i].r,
+					ref[i].g,
+					ref[i].b,
+					ref[i].a);
+				break;
+			}
+		return false;
+	}
+	return true;
+}
+
+static struct Vec2i
+randPoint(uint32_t *seed, int w, int h)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return (struct Vec2i){(int)((*seed >> 8) % (uint32_t)w),
+			      (int)((*seed >> 20) % (uint32_t)h)};
+}
+
+/* how strokes were drawn before spans: a whole stamp every step */
+static void
+strokeStamps(struct Image write,
+	     const struct Brush *b,
+	     struct ColorRGBA color,
+	     struct Vec2i v0,
+	     struct Vec2i v1)
+{
+	struct Vec2i d = {v1.x - v0.x, v1.y - v0.y};
+	int count = MAX(abs(d.x), abs(d.y));
+	for (int i = 0; i <= count; i++)
+	{
+		struct Vec2i p = strokeStep(v0, d, i, count);
+		for (int j = 0; j < b->n; j++)
+		{
+			int y = p.y + b->top + j;
+			int x0 = MAX(p.x + b->lo[j], 0);
+			int x1 = MIN(p.x + b->hi[j], write.w);
+			if (y >= 0 && y < write.h)
+				imgSpan(write, x0, x1, y, color);
+		}
+	}
+}
+
+/* spans must cover exactly what the stamps cover, anti-aliased strokes
+ * must match the coverage of every pixel & strokeRect must hold both */
+static bool
+checkStroke(void)
+{
+	enum { W = 200, H = 150 };
+	static struct ColorRGBA a[W * H], b[W * H];
+	struct Recti all = {{0, 0}, {W, H}};
+	struct ColorRGBA c = {0x12, 0x34, 0x56, 0xff}, clear = {0, 0, 0, 0};
+	struct Brush brush = {0};
+	struct Image ia, ib;
+	if (!imgAlloc(&ia, W, H) || !imgAlloc(&ib, W, H))
+	{
+		perror("calloc failed");
+		exit(EXIT_FAILURE);
+	}
+
+	uint32_t seed = 5;
+	bool ok = true;
+	for (int round = 0; round < 2000 && ok; round++)
+	{
+		seed = seed * 1103515245 + 12345;
+		enum BrushShape shape = (seed >> 16) % 2;
+		double size = (double)(1 + (seed >> 18) % 80) / 2;
+		struct Vec2i v0 = randPoint(&seed, W, H);
+		struct Vec2i v1 = randPoint(&seed, W, H);
+		/* short strokes are the common case */
+		if (round % 2 == 0)
+			v1 = (struct Vec2i){MIN(v0.x + round % 5, W - 1),
+					    MAX(v0.y - round % 3, 0)};
+
+		brushSet(&brush, shape, size);
+		imageFill(ia, all, clear);
+		imageFill(ib, all, clear);
+		bool aa = shape == BRUSH_ROUND && round % 4 == 1;
+		struct Recti r = strokeBrush(ia, &brush, c, aa, v0, v1);
+		imgRead(ia, all, a, W);
+		if (aa)
+		{
+			double o = brush.n / 2.0 + brush.top;
+			double rad = brush.n / 2.0;
+			for (int y = 0; y < H; y++)
+				for (int x = 0; x < W; x++)
+				{
+					double d = mtSegmentDist(x + 0.5,
+								 y + 0.5,
+								 v0.x + o,
+								 v0.y + o,
+								 v1.x + o,
+								 v1.y + o);
+					double cov = rad + 0.5 - d;
+					cov = cov < 0 ? 0 : cov > 1 ? 1 : cov;
+					struct ColorRGBA *e = &b[x + y * W];
+					*e = c;
+					e->a = (unsigned char)(cov * 0xff + .5);
+					if (e->a == 0)
+						*e = clear;
+				}
+		} else
+		{
+			strokeStamps(ib, &brush, c, v0, v1);
+			imgRead(ib, all, b, W);
+		}
+
+		for (int i = 0; i < W * H && ok; i++)
+		{
+			struct Vec2i p = {i % W, i / W};
+			bool in = p.x >= r.pos.x && p.x < r.pos.x + r.size.x &&
+				  p.y >= r.pos.y && p.y < r.pos.y + r.size.y;
+			if (memcmp(&a[i], &b[i], sizeof a[i]) == 0 &&
+			    (in || a[i].a == 0))
+				continue;
+
+			fprintf(stderr,
+				"strokeBrush: %s%s size %.1f from %d,%d to "
+				"%d,%d: pixel %d,%d has alpha %u, expected "
+				"%u\n",
+				aa ? "anti-aliased " : "",
+				shape == BRUSH_ROUND ? "round" : "square",
+				size,
+				v0.x,
+				v0.y,
+				v1.x,
+				v1.y,
+				p.x,
+				p.y,
+				a[i].a,
+				b[i].a);
+			ok = false;
+		}
+	}
+
+	brushFree(&brush);
+	imgFree(&ia);
+	imgFree(&ib);
+	return ok;
+}
+
+/* everything a kernel works on. images are size x size, bands are one row
+ * of tiles tall like the ones pie loads & saves through */
+struct Bench {
+	int w, h, bandH;
+	struct Image img, drw;
+	/* one band of farbfeld samples & two bands of pixels */
+	unsigned char *ff;
+	struct ColorRGBA *band, *band2;
+	struct Brush brush;
+	FILE *ffFile;
+	int null;
+	uint32_t seed;
+};
+
+struct Kernel {
+	const char *name;
+	/* bytes each pixel moves, for GB/s */
+	double bytes;
+	/* runs untimed before every timed run. may be NULL */
+	void (*setup)(struct Bench *b);
+	/* returns the number of pixels processed */
+	size_t (*run)(struct Bench *b);
+};
+
+static void *
+xmalloc(size_t size)
+{
+	void *p = malloc(size);
+	if (p == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+static void
+benchInit(struct Bench *b, int size)
+{
+	*b = (struct Bench){0};
+	b->w = b->h = size;
+	b->bandH = MIN(TILE_SIZE, size);
+	b->seed = 1;
+	if (!imgAlloc(&b->img, size, size) || !imgAlloc(&b->drw, size, size))
+	{
+		perror("calloc failed");
+		exit(EXIT_FAILURE);
+	}
+
+	size_t pixels = (size_t)size * (size_t)b->bandH;
+	b->ff = xmalloc(16 + pixels * 8);
+	b->band = xmalloc(pixels * sizeof *b->band);
+	b->band2 = xmalloc(pixels * sizeof *b->band2);
+	ffHeader(b->ff, size, size);
+	for (size_t i = 16; i < 16 + pixels * 8; i++)
+	{
+		b->seed = b->seed * 1103515245 + 12345;
+		b->ff[i] = (unsigned char)(b->seed >> 16);
+	}
+	b->ffFile = fmemopen(b->ff, 16 + pixels * 8, "r");
+	b->null = open("/dev/null", O_WRONLY);
+	if (b->ffFile == NULL || b->null == -1)
+	{
+		perror("failed to open benchmark files");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void
+benchFree(struct Bench *b)
+{
+	imgFree(&b->img);
+	imgFree(&b->drw);
+	free(b->ff);
+	free(b->band);
+	free(b->band2);
+	brushFree(&b->brush);
+	fclose(b->ffFile);
+	close(b->null);
+}
+
+static inline struct Recti
+benchBand(struct Bench *b, int y)
+{
+	return (struct Recti){{0, y}, {b->w, MIN(b->bandH, b->h - y)}};
+}
+
+static size_t
+kDecode(struct Bench *b)
+{
+	for (int y = 0; y < b->h; y += b->bandH)
+	{
+		struct Recti r = benchBand(b, y);
+		ffDecode(b->ff + 16,
+			 (unsigned char *)b->band,
+			 (size_t)r.size.x * (size_t)r.size.y * 4);
+	}
+	return (size_t)b->w * (size_t)b->h;
+}
+
+/* what pie's ffread does, with every band read from the same data */
+static size_t
+kRead(struct Bench *b)
+{
+	int w, h;
+	rewind(b->ffFile);
+	if (!ffreadHeader(b->ffFile, &w, &h))
+		exit(EXIT_FAILURE);
+	for (int y = 0; y < h; y += b->bandH)
+	{
+		struct Recti r = benchBand(b, y);
+		fseek(b->ffFile, 16, SEEK_SET);
+		if (!ffreadBody(b->ffFile,
+				b->band,
+				(size_t)r.size.x * (size_t)r.size.y))
+			exit(EXIT_FAILURE);
+		imgWrite(b->img, r, b->band, (size_t)b->w);
+		struct Tile *row = &b->img.tiles[(y >> TILE_SHIFT) * b->img.tw];
+		for (int tx = 0; tx < b->img.tw; tx++)
+			tileCompact(&row[tx]);
+	}
+	return (size_t)b->w * (size_t)b->h;
+}
+
+/* what pie's ffwrite does */
+static size_t
+kWrite(struct Bench *b)
+{
+	if (!ffwriteHeader(b->null, b->w, b->h))
+		exit(EXIT_FAILURE);
+	for (int y = 0; y < b->h; y += b->bandH)
+	{
+		struct Recti r = benchBand(b, y);
+		imgRead(b->img, r, b->band, (size_t)b->w);
+		if (!ffwriteBody(b->null,
+				 b->band,
+				 (size_t)r.size.x * (size_t)r.size.y))
+			exit(EXIT_FAILURE);
+	}
+	return (size_t)b->w * (size_t)b->h;
+}
+
+/* random stroke layer over an opaque image, as commits leave it empty */
+static void
+sCommit(struct Bench *b)
+{
+	struct Recti r = benchBand(b, 0);
+	size_t pixels = (size_t)r.size.x * (size_t)r.size.y;
+	uint32_t seed = 3;
+	for (size_t i = 0; i < pixels; i++)
+	{
+		b->band[i] = randColor(&seed);
+		b->band[i].a = 0xff;
+		b->band2[i] = randColor(&seed);
+	}
+	for (int y = 0; y < b->h; y += b->bandH)
+	{
+		imgWrite(b->img, benchBand(b, y), b->band, (size_t)b->w);
+		imgWrite(b->drw, benchBand(b, y), b->band2, (size_t)b->w);
+	}
+}
+
+static size_t
+kCommit(struct Bench *b)
+{
+	struct Recti r = {{0, 0}, {b->w, b->h}};
+	commitDraw(b->img, b->drw, r);
+	return (size_t)b->w * (size_t)b->h;
+}
+
+/* one band of random pixels blended over one of opaque ones */
+static void
+sBlend(struct Bench *b)
+{
+	struct Recti r = benchBand(b, 0);
+	size_t pixels = (size_t)r.size.x * (size_t)r.size.y;
+	uint32_t seed = 9;
+	for (size_t i = 0; i < pixels; i++)
+	{
+		b->band[i] = randColor(&seed);
+		b->band[i].a = 0xff;
+		b->band2[i] = randColor(&seed);
+	}
+}
+
+static size_t
+kMtBlend(struct Bench *b)
+{
+	struct Recti r = benchBand(b, 0);
+	size_t pixels = (size_t)r.size.x * (size_t)r.size.y;
+	for (size_t i = 0; i < pixels; i++)
+		b->band[i] = mtBlend(b->band2[i], b->band[i]);
+	return pixels;
+}
+
+static size_t
+kBlendRow(struct Bench *b)
+{
+	struct Recti r = benchBand(b, 0);
+	size_t pixels = (size_t)r.size.x * (size_t)r.size.y;
+	blendRow(b->band, b->band2, pixels);
+	return pixels;
+}
+
+/* off by one pixel from the edges, so the border tiles take spans */
+static size_t
+kFill(struct Bench *b)
+{
+	struct Recti r = {{1, 1}, {b->w - 2, b->h - 2}};
+	b->seed = b->seed * 1103515245 + 12345;
+	r = imageFill(b->img, r, randColor(&b->seed));
+	return (size_t)r.size.x * (size_t)r.size.y;
+}
+
+/* pixels the last strokeSpans call covered */
+static size_t
+strokePixels(struct Brush *br,
+	     struct Image img,
+	     struct Vec2i v0,
+	     struct Vec2i v1)
+{
+	size_t n = 0;
+	int base = MIN(v0.y, v1.y) + br->top;
+	for (int i = 0; i < abs(v1.y - v0.y) + br->n; i++)
+	{
+		int x0 = MAX(br->rowLo[i], 0), x1 = MIN(br->rowHi[i], img.w);
+		if (base + i >= 0 && base + i < img.h && x0 < x1)
+			n += (size_t)(x1 - x0);
+	}
+	return n;
+}
+
+/* corner to corner with a brush a sixteenth of the image wide */
+static size_t
+kStroke(struct Bench *b)
+{
+	struct Vec2i v0 = {0, 0}, v1 = {b->w - 1, b->h - 1};
+	struct ColorRGBA c = {0x12, 0x34, 0x56, 0xff};
+	brushSet(&b->brush, BRUSH_ROUND, MAX(b->w / 32.0, 0.5));
+	strokeBrush(b->drw, &b->brush, c, false, v0, v1);
+	return strokePixels(&b->brush, b->drw, v0, v1);
+}
+
+static size_t
+kSample(struct Bench *b)
+{
+	struct ColorRGBA c = {0};
+	uint32_t seed = 11;
+	unsigned int sum = 0;
+	for (size_t i = 0; i < BENCH_SAMPLES; i++)
+	{
+		struct Vec2i p = randPoint(&seed, b->w, b->h);
+		sampleImg(b->img, p.x, p.y, &c);
+		sum += c.r;
+	}
+	/* keeps the loop from being optimized out */
+	b->seed += sum;
+	return BENCH_SAMPLES;
+}
+
+static const struct Kernel kernels[] = {
+	{"ffdecode", 8, NULL, kDecode},
+	{"ffread", 8, NULL, kRead},
+	{"ffwrite", 8, NULL, kWrite},
+	{"commitdraw", 8, sCommit, kCommit},
+	{"mtblend", 8, sBlend, kMtBlend},
+	{"blendrow", 8, sBlend, kBlendRow},
+	{"imagefill", 4, NULL, kFill},
+	{"stroke", 4, NULL, kStroke},
+	{"sampleimg", 4, NULL, kSample},
+};
+
+/* ns per pixel of the best of up to BENCH_REPS samples after a warmup one.
+ * every sample repeats the kernel for at least BENCH_SAMPLE_TIME seconds &
+ * sampling stops early once BENCH_TIME seconds were spent */
+static double
+benchKernel(struct Bench *b, const struct Kernel *k)
+{
+	double best = 1e9, start = now();
+	for (int rep = 0; rep <= BENCH_REPS; rep++)
+	{
+		double t = 0;
+		size_t pixels = 0;
+		while (t < BENCH_SAMPLE_TIME)
+		{
+			if (k->setup != NULL)
+				k->setup(b);
+			double t0 = now();
+			pixels += k->run(b);
+			t += now() - t0;
+		}
+
+		if (rep > 0 && t / (double)pixels < best)
+			best = t / (double)pixels;
+		if (rep > 1 && now() - start > BENCH_TIME)
+			break;
+	}
+	return best * 1e9;
+}
+
+/* draws the same stroke by stamping & by spans, for brushes 1 to 256 wide */
+static void
+benchStroke(void)
+{
+	struct Image img;
+	if (!imgAlloc(&img, BENCH_STROKE_SIZE, BENCH_STROKE_SIZE))
+	{
+		perror("calloc failed");
+		exit(EXIT_FAILURE);
+	}
+
+	struct Brush b = {0};
+	struct ColorRGBA c = {0x12, 0x34, 0x56, 0xff};
+	struct Vec2i v0 = {64, 64};
+	struct Vec2i v1 = {BENCH_STROKE_SIZE - 64, BENCH_STROKE_SIZE * 2 / 3};
+	for (int shape = BRUSH_SQUARE; shape <= BRUSH_ROUND; shape++)
+		for (int n = 1; n <= 256; n *= 2)
+		{
+			brushSet(&b, shape, n / 2.0);
+			strokeBrush(img, &b, c, false, v0, v1);
+			size_t pixels = strokePixels(&b, img, v0, v1);
+
+			double best[2] = {1e9, 1e9};
+			for (int i = 0; i <= BENCH_REPS; i++)
+			{
+				double t = now();
+				strokeStamps(img, &b, c, v0, v1);
+				t = now() - t;
+				if (i > 0 && t < best[0])
+					best[0] = t;
+
+				t = now();
+				strokeBrush(img, &b, c, false, v0, v1);
+				t = now() - t;
+				if (i > 0 && t < best[1])
+					best[1] = t;
+			}
+
+			const char *name[2] = {"stamps", "spans"};
+			const char *sh =
+				shape == BRUSH_ROUND ? "round" : "square";
+			for (int i = 0; i < 2; i++)
+			{
+				double ns = best[i] * 1e9 / (double)pixels;
+				printf("%s-%s-%d\t%d\t%d\t%.3f\t%.3f\n",
+				       name[i],
+				       sh,
+				       n,
+				       BENCH_STROKE_SIZE,
+				       BENCH_STROKE_SIZE,
+				       ns,
+				       4 / ns);
+			}
+		}
+
+	brushFree(&b);
+	imgFree(&img);
+}
+
+int
+main(int argc, char **argv)
+{
+	int max = BENCH_MAX_SIZE;
+	if (argc > 2 || (argc == 2 && (max = atoi(argv[1])) < 32))
+	{
+		fprintf(stderr, "usage: %s [largest size >= 32]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (!checkDecode() || !checkEncode() || !checkBlend() ||
+	    !checkStroke())
+		return EXIT_FAILURE;
+
+	double slowest = -1;
+	printf("# kernel\tw\th\tns/px\tGB/s\n");
+	for (int size = 32; size <= max; size = size < max / 4 ? size * 4 : max)
+	{
+		struct Bench b;
+		benchInit(&b, size);
+		for (size_t i = 0; i < sizeof kernels / sizeof *kernels; i++)
+		{
+			double ns = benchKernel(&b, &kernels[i]);
+			double gbs = kernels[i].bytes / ns;
+			printf("%s\t%d\t%d\t%.3f\t%.3f\n",
+			       kernels[i].name,
+			       size,
+			       size,
+			       ns,
+			       gbs);
+			fflush(stdout);
+			if (i == 0 && (slowest < 0 || gbs < slowest))
+				slowest = gbs;
+		}
+		benchFree(&b);
+		if (size == max)
+			break;
+	}
+	benchStroke();
+
+	if (slowest * 1e3 < TARGET_DECODE_MBS)
+		fprintf(stderr,
+			"ffdecode at %.0f MB/s, below the target of %d MB/s\n",
+			slowest * 1e3,
+			TARGET_DECODE_MBS);
+	return EXIT_SUCCESS;
+}
@@ -4,7 +4,12 @@
  * see LICENSE file for the license text */
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
@@ -26,7 +31,7 @@ struct Rect {
 };
 
 struct ImgShader {
-	unsigned int id, uWin, uTr;
+	unsigned int id, uWin, uTr, uUV;
 };
 
 static const char *imgVertSrc =
@@ -35,12 +40,14 @@ static const char *imgVertSrc =
 	"out vec2 texCoord;"
 	"uniform vec4 uTr;"
 	"uniform vec2 uWin;"
+	"uniform vec4 uUV;"
 	"void main() {"
 	"vec2 outPos = vec2(uTr.x, uTr.y) + "
 	"vec2(aPos.x * uTr.z, aPos.y * uTr.w);"
 	"gl_Position = vec4(outPos.x / uWin.x * 2 - 1,"
 	"outPos.y / uWin.y * -2 + 1, 0, 1);"
-	"texCoord = vec2(gl_VertexID & 1, (gl_VertexID & 0x2) >> 1);"
+	"texCoord = uUV.xy + uUV.zw * "
+	"vec2(gl_VertexID & 1, (gl_VertexID & 0x2) >> 1);"
 	"}";
 
 /* Vec2 p, Rect r */
@@ -106,17 +113,148 @@ grCompileShader(int type, const char *src)
 	return out;
 }
 
+/* linked programs are cached in $XDG_CACHE_HOME/pie, one file per pair of
+ * sources & driver. a file holds the binary format, then the binary */
+#define GR_CACHE_PATH 4096
+
+static uint64_t
+grHash(uint64_t h, const char *s)
+{
+	for (; s != NULL && *s != '\0'; s++)
+		h = (h ^ (unsigned char)*s) * 0x100000001b3;
+	/* keeps "ab" "c" apart from "a" "bc" */
+	return (h ^ 0xff) * 0x100000001b3;
+}
+
+/* the cache file of the program linked from vertSrc & fragSrc with this
+ * driver. creates the cache directory. false if there is none */
+static bool
+grCachePath(char *out, const char *vertSrc, const char *fragSrc)
+{
+	const char *base = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	/* leaves room for the file name */
+	char dir[GR_CACHE_PATH - 32];
+	int n;
+	/* relative paths in XDG_CACHE_HOME are to be ignored */
+	if (base != NULL && base[0] == '/')
+		n = snprintf(dir, sizeof dir, "%s/pie", base);
+	else if (home != NULL && home[0] == '/')
+		n = snprintf(dir, sizeof dir, "%s/.cache/pie", home);
+	else
+		return false;
+	if (n < 0 || (size_t)n >= sizeof dir)
+		return false;
+
+	for (char *p = dir + 1; *p != '\0'; p++)
+		if (*p == '/')
+		{
+			*p = '\0';
+			mkdir(dir, 0755);
+			*p = '/';
+		}
+	mkdir(dir, 0700);
+
+	uint64_t h = 0xcbf29ce484222325;
+	h = grHash(h, vertSrc);
+	h = grHash(h, fragSrc);
+	h = grHash(h, (const char *)glGetString(GL_VENDOR));
+	h = grHash(h, (const char *)glGetString(GL_RENDERER));
+	h = grHash(h, (const char *)glGetString(GL_VERSION));
+	snprintf(out,
+		 GR_CACHE_PATH,
+		 "%s/%016llx",
+		 dir,
+		 (unsigned long long)h);
+	return true;
+}
+
+/* loads the cached binary into shader. false if it is missing or the
+ * driver rejects it */
+static bool
+grCacheLoad(unsigned int shader, const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	if (f == NULL)
+		return false;
+
+	uint32_t format;
+	long len = -1;
+	if (fread(&format, sizeof format, 1, f) == 1 &&
+	    fseek(f, 0, SEEK_END) == 0)
+		len = ftell(f) - (long)sizeof format;
+	void *bin = len > 0 ? malloc((size_t)len) : NULL;
+	bool ok = bin != NULL &&
+		  fseek(f, sizeof format, SEEK_SET) == 0 &&
+		  fread(bin, (size_t)len, 1, f) == 1;
+	fclose(f);
+
+	int linked = 0;
+	if (ok)
+	{
+		glProgramBinary(shader, format, bin, (int)len);
+		glGetProgramiv(shader, GL_LINK_STATUS, &linked);
+	}
+	free(bin);
+	return linked;
+}
+
+/* writes the binary of shader to path, through a temporary file so readers
+ * never see half a binary */
+static void
+grCacheStore(unsigned int shader, const char *path)
+{
+	int len = 0;
+	glGetProgramiv(shader, GL_PROGRAM_BINARY_LENGTH, &len);
+	void *bin = len > 0 ? malloc((size_t)len) : NULL;
+	if (bin == NULL)
+		return;
+
+	GLenum format;
+	glGetProgramBinary(shader, len, &len, &format, bin);
+	char tmp[GR_CACHE_PATH + 32];
+	snprintf(tmp, sizeof tmp, "%s.%ld", path, (long)getpid());
+	FILE *f = fopen(tmp, "wb");
+	if (f != NULL)
+	{
+		uint32_t format32 = format;
+		bool ok = fwrite(&format32, sizeof format32, 1, f) == 1 &&
+			  fwrite(bin, (size_t)len, 1, f) == 1;
+		ok &= fclose(f) == 0;
+		if (!ok || rename(tmp, path) != 0)
+			remove(tmp);
+	}
+	free(bin);
+}
+
 static unsigned int
 grGenShader(const char *vertSrc, const char *fragSrc)
 {
+	unsigned int shader = glCreateProgram();
+
+	/* drivers may support the calls but no binary format, like mesa
+	 * with its shader cache disabled */
+	int formats = 0;
+	if (GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary)
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	char path[GR_CACHE_PATH];
+	bool cache = formats > 0 && grCachePath(path, vertSrc, fragSrc);
+	if (cache && grCacheLoad(shader, path))
+	{
+		glUseProgram(shader);
+		return shader;
+	}
+
 	unsigned int shv = grCompileShader(GL_VERTEX_SHADER, vertSrc);
 	unsigned int shf = grCompileShader(GL_FRAGMENT_SHADER, fragSrc);
 
-	unsigned int shader = glCreateProgram();
-
 	glAttachShader(shader, shv);
 	glAttachShader(shader, shf);
 
+	if (cache)
+		glProgramParameteri(shader,
+				    GL_PROGRAM_BINARY_RETRIEVABLE_HINT,
+				    GL_TRUE);
 	glLinkProgram(shader);
 
 	int success;
@@ -126,7 +264,8 @@ grGenShader(const char *vertSrc, const char *fragSrc)
 		char infolog[512];
 		glGetProgramInfoLog(shader, 512, 0, infolog);
 		fprintf(stderr, "%s\n", infolog);
-	}
+	} else if (cache)
+		grCacheStore(shader, path);
 
 	glUseProgram(shader);
 
@@ -142,6 +281,10 @@ grImgInitGr(struct ImgShader *sh, const char *fragSrc)
 	sh->id = grGenShader(imgVertSrc, fragSrc);
 	sh->uTr = glGetUniformLocation(sh->id, "uTr");
 	sh->uWin = glGetUniformLocation(sh->id, "uWin");
+	sh->uUV = glGetUniformLocation(sh->id, "uUV");
+	/* the whole texture unless grImgUpdateUV says otherwise */
+	glUseProgram(sh->id);
+	glUniform4f(sh->uUV, 0, 0, 1, 1);
 }
 
 static inline void
@@ -151,6 +294,13 @@ grImgUpdate(struct ImgShader *sh, struct Rect r, double winW, double winH)
 	glUniform2f(sh->uWin, winW, winH);
 }
 
+/* samples the part of the texture at uv instead of the whole of it */
+static inline void
+grImgUpdateUV(struct ImgShader *sh, struct Rect uv)
+{
+	glUniform4f(sh->uUV, uv.pos.x, uv.pos.y, uv.size.x, uv.size.y);
+}
+
 static inline bool
 grInit(void *data,
        GLFWwindow **window,
@@ -0,0 +1,239 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ * copyright 2025-2026 mannikim <mannikim[at]proton[dot]me>
+ * this file is part of pie
+ * see LICENSE file for the license text
+
+farbfeld encoding & decoding. requires struct ColorRGBA to be defined */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/* pixels converted per read or write call */
+#define FF_CHUNK 65536
+
+static inline uint32_t
+ffbe32(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	       (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+static inline void
+ffHeader(unsigned char *out, int w, int h)
+{
+	memcpy(out, "farbfeld", 8);
+	for (size_t i = 0; i < 4; i++)
+	{
+		out[8 + i] = (unsigned char)((uint32_t)w >> (24 - i * 8));
+		out[12 + i] = (unsigned char)((uint32_t)h >> (24 - i * 8));
+	}
+}
+
+/* converts n big-endian 16-bit samples to 8-bit samples (x / 257).
+ * (x * 0xff01) >> 24 equals x / 257 for every 16-bit x */
+static void
+ffDecode(const unsigned char *in, unsigned char *out, size_t n)
+{
+	size_t i = 0;
+#ifdef __AVX2__
+	const __m256i k8 = _mm256_set1_epi16((short)0xff01);
+	for (; i + 32 <= n; i += 32)
+	{
+		__m256i a = _mm256_loadu_si256((const void *)(in + i * 2));
+		__m256i b = _mm256_loadu_si256((const void *)(in + i * 2 + 32));
+		a = _mm256_or_si256(_mm256_slli_epi16(a, 8),
+				    _mm256_srli_epi16(a, 8));
+		b = _mm256_or_si256(_mm256_slli_epi16(b, 8),
+				    _mm256_srli_epi16(b, 8));
+		a = _mm256_srli_epi16(_mm256_mulhi_epu16(a, k8), 8);
+		b = _mm256_srli_epi16(_mm256_mulhi_epu16(b, k8), 8);
+		/* packus works per 128-bit lane */
+		__m256i r = _mm256_packus_epi16(a, b);
+		r = _mm256_permute4x64_epi64(r, 0xd8);
+		_mm256_storeu_si256((void *)(out + i), r);
+	}
+#endif
+#ifdef __SSE2__
+	const __m128i k4 = _mm_set1_epi16((short)0xff01);
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i a = _mm_loadu_si128((const void *)(in + i * 2));
+		__m128i b = _mm_loadu_si128((const void *)(in + i * 2 + 16));
+		a = _mm_or_si128(_mm_slli_epi16(a, 8), _mm_srli_epi16(a, 8));
+		b = _mm_or_si128(_mm_slli_epi16(b, 8), _mm_srli_epi16(b, 8));
+		a = _mm_srli_epi16(_mm_mulhi_epu16(a, k4), 8);
+		b = _mm_srli_epi16(_mm_mulhi_epu16(b, k4), 8);
+		_mm_storeu_si128((void *)(out + i), _mm_packus_epi16(a, b));
+	}
+#endif
+	for (; i < n; i++)
+	{
+		unsigned int x = (unsigned int)in[i * 2] << 8 | in[i * 2 + 1];
+		out[i] = (unsigned char)(x / 257);
+	}
+}
+
+/* reads and validates the header. prints the reason on failure */
+static bool
+ffreadHeader(FILE *f, int *w, int *h)
+{
+	unsigned char header[16];
+	if (fread(header, sizeof header, 1, f) != 1)
+	{
+		fprintf(stderr, "failed to read farbfeld header\n");
+		return false;
+	}
+	if (memcmp(header, "farbfeld", 8) != 0)
+	{
+		fprintf(stderr, "failed to parse farbfeld magic value\n");
+		return false;
+	}
+
+	uint32_t fw = ffbe32(header + 8), fh = ffbe32(header + 12);
+	if (fw == 0 || fh == 0 || fw > INT_MAX || fh > INT_MAX ||
+	    (uint64_t)fw * fh > SIZE_MAX / 8)
+	{
+		fprintf(stderr,
+			"invalid farbfeld size %lux%lu\n",
+			(unsigned long)fw,
+			(unsigned long)fh);
+		return false;
+	}
+
+	*w = (int)fw;
+	*h = (int)fh;
+	return true;
+}
+
+/* decodes the body of f into out. prints the reason on failure */
+static bool
+ffreadBody(FILE *f, struct ColorRGBA *out, size_t pixels)
+{
+	unsigned char *buf = malloc(FF_CHUNK * 8);
+	if (buf == NULL)
+	{
+		perror("malloc failed");
+		return false;
+	}
+
+	size_t done = 0;
+	while (done < pixels)
+	{
+		size_t n = pixels - done < FF_CHUNK ? pixels - done : FF_CHUNK;
+		size_t got = fread(buf, 8, n, f);
+		ffDecode(buf, (unsigned char *)(out + done), got * 4);
+		done += got;
+		if (got == n)
+			continue;
+
+		if (ferror(f))
+			perror("failed to read farbfeld data");
+		else
+			fprintf(stderr,
+				"farbfeld data ended after %zu of %zu pixels\n",
+				done,
+				pixels);
+		free(buf);
+		return false;
+	}
+
+	free(buf);
+	return true;
+}
+
+/* converts n 8-bit samples to big-endian 16-bit samples (x * 257), which is
+ * every byte written twice */
+static void
+ffEncode(const unsigned char *in, unsigned char *out, size_t n)
+{
+	size_t i = 0;
+#ifdef __AVX2__
+	for (; i + 32 <= n; i += 32)
+	{
+		__m256i a = _mm256_loadu_si256((const void *)(in + i));
+		/* unpack works per 128-bit lane */
+		a = _mm256_permute4x64_epi64(a, 0xd8);
+		_mm256_storeu_si256((void *)(out + i * 2),
+				    _mm256_unpacklo_epi8(a, a));
+		_mm256_storeu_si256((void *)(out + i * 2 + 32),
+				    _mm256_unpackhi_epi8(a, a));
+	}
+#endif
+#ifdef __SSE2__
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i a = _mm_loadu_si128((const void *)(in + i));
+		_mm_storeu_si128((void *)(out + i * 2),
+				 _mm_unpacklo_epi8(a, a));
+		_mm_storeu_si128((void *)(out + i * 2 + 16),
+				 _mm_unpackhi_epi8(a, a));
+	}
+#endif
+	for (; i < n; i++)
+	{
+		out[i * 2] = in[i];
+		out[i * 2 + 1] = in[i];
+	}
+}
+
+static bool
+ffwriteAll(int fd, const unsigned char *buf, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t n = write(fd, buf, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+		{
+			perror("failed to write farbfeld data");
+			return false;
+		}
+		buf += n;
+		len -= (size_t)n;
+	}
+	return true;
+}
+
+static inline bool
+ffwriteHeader(int fd, int w, int h)
+{
+	unsigned char header[16];
+	ffHeader(header, w, h);
+	return ffwriteAll(fd, header, sizeof header);
+}
+
+/* encodes pixels straight to fd, bypassing stdio. prints the reason on
+ * failure */
+static bool
+ffwriteBody(int fd, const struct ColorRGBA *data, size_t pixels)
+{
+	unsigned char *buf = malloc(FF_CHUNK * 8);
+	if (buf == NULL)
+	{
+		perror("malloc failed");
+		return false;
+	}
+
+	bool ok = true;
+	for (size_t done = 0; ok && done < pixels;)
+	{
+		size_t n = pixels - done < FF_CHUNK ? pixels - done : FF_CHUNK;
+		ffEncode((const unsigned char *)(data + done), buf, n * 4);
+		ok = ffwriteAll(fd, buf, n * 8);
+		done += n;
+	}
+
+	free(buf);
+	return ok;
+}
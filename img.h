@@ -0,0 +1,1093 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ * copyright 2025-2026 mannikim <mannikim[at]proton[dot]me>
+ * this file is part of pie
+ * see LICENSE file for the license text
+
+image storage & pixel kernels. requires struct ColorRGBA and struct Vec2i to
+be defined */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define TILE_SHIFT 6
+#define TILE_SIZE (1 << TILE_SHIFT)
+#define TILE_PIXELS (TILE_SIZE * TILE_SIZE)
+
+/* a TILE_SIZE x TILE_SIZE block of pixels, rows are TILE_SIZE pixels apart.
+ * tiles where every pixel is fill have no data. shared data also belongs to
+ * a snapshot, see imgShare, so it is copied before it changes & never freed
+ * here */
+struct Tile {
+	struct ColorRGBA *data;
+	struct ColorRGBA fill;
+	bool shared;
+};
+
+/* images are stored as a table of tiles. the last column & row of tiles
+ * may reach past w & h */
+struct Image {
+	struct Tile *tiles;
+	int w, h;
+	int tw, th;
+};
+
+struct Recti {
+	struct Vec2i pos, size;
+};
+
+static inline bool
+rectEmpty(struct Recti r)
+{
+	return r.size.x <= 0 || r.size.y <= 0;
+}
+
+static inline struct Recti
+rectUnion(struct Recti a, struct Recti b)
+{
+	if (rectEmpty(a))
+		return b;
+	if (rectEmpty(b))
+		return a;
+
+	int x0 = MIN(a.pos.x, b.pos.x), y0 = MIN(a.pos.y, b.pos.y);
+	int x1 = MAX(a.pos.x + a.size.x, b.pos.x + b.size.x);
+	int y1 = MAX(a.pos.y + a.size.y, b.pos.y + b.size.y);
+	return (struct Recti){{x0, y0}, {x1 - x0, y1 - y0}};
+}
+
+static inline struct Recti
+rectClip(struct Recti r, int w, int h)
+{
+	int x0 = MAX(r.pos.x, 0), y0 = MAX(r.pos.y, 0);
+	int x1 = MIN(r.pos.x + r.size.x, w), y1 = MIN(r.pos.y + r.size.y, h);
+	if (x1 <= x0 || y1 <= y0)
+		return (struct Recti){{0, 0}, {0, 0}};
+	return (struct Recti){{x0, y0}, {x1 - x0, y1 - y0}};
+}
+
+static inline struct Recti
+rectIntersect(struct Recti a, struct Recti b)
+{
+	int x0 = MAX(a.pos.x, b.pos.x), y0 = MAX(a.pos.y, b.pos.y);
+	int x1 = MIN(a.pos.x + a.size.x, b.pos.x + b.size.x);
+	int y1 = MIN(a.pos.y + a.size.y, b.pos.y + b.size.y);
+	if (x1 <= x0 || y1 <= y0)
+		return (struct Recti){{0, 0}, {0, 0}};
+	return (struct Recti){{x0, y0}, {x1 - x0, y1 - y0}};
+}
+
+static inline bool
+rectEqual(struct Recti a, struct Recti b)
+{
+	return a.pos.x == b.pos.x && a.pos.y == b.pos.y &&
+	       a.size.x == b.size.x && a.size.y == b.size.y;
+}
+
+/* the part of a outside b, grown to a rectangle where it is not one */
+static inline struct Recti
+rectSubtract(struct Recti a, struct Recti b)
+{
+	struct Recti i = rectIntersect(a, b);
+	if (rectEmpty(i))
+		return a;
+	if (rectEqual(i, a))
+		return (struct Recti){{0, 0}, {0, 0}};
+	/* b spans a from side to side, so one strip of a is left */
+	if (i.size.x == a.size.x && i.pos.y == a.pos.y)
+		return (struct Recti){{a.pos.x, i.pos.y + i.size.y},
+				      {a.size.x, a.size.y - i.size.y}};
+	if (i.size.x == a.size.x && i.pos.y + i.size.y == a.pos.y + a.size.y)
+		return (struct Recti){a.pos, {a.size.x, a.size.y - i.size.y}};
+	if (i.size.y == a.size.y && i.pos.x == a.pos.x)
+		return (struct Recti){{i.pos.x + i.size.x, a.pos.y},
+				      {a.size.x - i.size.x, a.size.y}};
+	if (i.size.y == a.size.y && i.pos.x + i.size.x == a.pos.x + a.size.x)
+		return (struct Recti){a.pos, {a.size.x - i.size.x, a.size.y}};
+	return a;
+}
+
+/* allocates the tile table. every tile starts out transparent */
+static inline bool
+imgAlloc(struct Image *img, int w, int h)
+{
+	img->w = w;
+	img->h = h;
+	img->tw = (w + TILE_SIZE - 1) >> TILE_SHIFT;
+	img->th = (h + TILE_SIZE - 1) >> TILE_SHIFT;
+	img->tiles = calloc((size_t)img->tw * (size_t)img->th,
+			    sizeof *img->tiles);
+	return img->tiles != NULL;
+}
+
+static inline void
+imgFree(struct Image *img)
+{
+	if (img->tiles == NULL)
+		return;
+	for (size_t i = 0; i < (size_t)img->tw * (size_t)img->th; i++)
+		free(img->tiles[i].data);
+	free(img->tiles);
+	img->tiles = NULL;
+}
+
+static inline struct Tile *
+imgTile(struct Image img, int x, int y)
+{
+	return &img.tiles[(x >> TILE_SHIFT) + (y >> TILE_SHIFT) * img.tw];
+}
+
+/* the part of tile tx, ty that lies inside img */
+static inline struct Recti
+imgTileRect(struct Image img, int tx, int ty)
+{
+	struct Recti r = {{tx << TILE_SHIFT, ty << TILE_SHIFT},
+			  {TILE_SIZE, TILE_SIZE}};
+	return rectClip(r, img.w, img.h);
+}
+
+/* tiles overlapping r, which must lie inside the image */
+#define TILES_IN(r, tx0, ty0, tx1, ty1) \
+	int tx0 = (r).pos.x >> TILE_SHIFT, ty0 = (r).pos.y >> TILE_SHIFT; \
+	int tx1 = ((r).pos.x + (r).size.x - 1) >> TILE_SHIFT; \
+	int ty1 = ((r).pos.y + (r).size.y - 1) >> TILE_SHIFT
+
+/* returns the pixels of t to write to, allocating them if t is uniform or
+ * copying them if they are shared */
+static inline struct ColorRGBA *
+tileData(struct Tile *t)
+{
+	if (t->data != NULL && !t->shared)
+		return t->data;
+
+	struct ColorRGBA *p = malloc(TILE_PIXELS * sizeof *p);
+	if (p == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	if (t->data != NULL)
+		memcpy(p, t->data, TILE_PIXELS * sizeof *p);
+	else
+		for (size_t i = 0; i < TILE_PIXELS; i++)
+			p[i] = t->fill;
+	t->data = p;
+	t->shared = false;
+	return p;
+}
+
+static inline void
+tileSetFill(struct Tile *t, struct ColorRGBA c)
+{
+	if (!t->shared)
+		free(t->data);
+	t->data = NULL;
+	t->fill = c;
+	t->shared = false;
+}
+
+/* frees the pixels of t if they are all the same */
+static inline void
+tileCompact(struct Tile *t)
+{
+	if (t->data == NULL)
+		return;
+	for (size_t i = 1; i < TILE_PIXELS; i++)
+		if (memcmp(&t->data[i], &t->data[0], sizeof *t->data) != 0)
+			return;
+	tileSetFill(t, t->data[0]);
+}
+
+static inline size_t
+tileOffset(int x, int y)
+{
+	return (size_t)(x & (TILE_SIZE - 1)) +
+	       (size_t)(y & (TILE_SIZE - 1)) * TILE_SIZE;
+}
+
+static inline struct ColorRGBA
+imgGet(struct Image img, int x, int y)
+{
+	struct Tile *t = imgTile(img, x, y);
+	return t->data == NULL ? t->fill : t->data[tileOffset(x, y)];
+}
+
+/* sets pixels x0 to x1 (exclusive) of row y, which must lie inside img */
+static inline void
+imgSpan(struct Image img, int x0, int x1, int y, struct ColorRGBA c)
+{
+	while (x0 < x1)
+	{
+		int end = MIN((x0 | (TILE_SIZE - 1)) + 1, x1);
+		struct Tile *t = imgTile(img, x0, y);
+		if (t->data != NULL || memcmp(&t->fill, &c, sizeof c) != 0)
+		{
+			struct ColorRGBA *p = tileData(t) + tileOffset(x0, y);
+			for (int i = 0; i < end - x0; i++)
+				p[i] = c;
+		}
+		x0 = end;
+	}
+}
+
+/* copies the r region of img to dst, whose rows are stride pixels apart */
+static inline void
+imgRead(struct Image img, struct Recti r, struct ColorRGBA *dst, size_t stride)
+{
+	int x1 = r.pos.x + r.size.x;
+	for (int y = r.pos.y; y < r.pos.y + r.size.y; y++, dst += stride)
+		for (int x = r.pos.x; x < x1;)
+		{
+			int end = MIN((x | (TILE_SIZE - 1)) + 1, x1);
+			struct Tile *t = imgTile(img, x, y);
+			struct ColorRGBA *d = dst + (x - r.pos.x);
+			if (t->data == NULL)
+				for (int i = 0; i < end - x; i++)
+					d[i] = t->fill;
+			else
+				memcpy(d,
+				       t->data + tileOffset(x, y),
+				       (size_t)(end - x) * sizeof *d);
+			x = end;
+		}
+}
+
+/* copies src, whose rows are stride pixels apart, to the r region of img */
+static inline void
+imgWrite(struct Image img,
+	 struct Recti r,
+	 const struct ColorRGBA *src,
+	 size_t stride)
+{
+	int x1 = r.pos.x + r.size.x;
+	for (int y = r.pos.y; y < r.pos.y + r.size.y; y++, src += stride)
+		for (int x = r.pos.x; x < x1;)
+		{
+			int end = MIN((x | (TILE_SIZE - 1)) + 1, x1);
+			struct Tile *t = imgTile(img, x, y);
+			memcpy(tileData(t) + tileOffset(x, y),
+			       src + (x - r.pos.x),
+			       (size_t)(end - x) * sizeof *src);
+			x = end;
+		}
+}
+
+/* x / 255 rounded, exact for x <= 65535 */
+static inline unsigned int
+mtDiv255(unsigned int x)
+{
+	x += 128;
+	return (x + (x >> 8)) >> 8;
+}
+
+/* a over b, both with straight alpha. the reference for blendRow */
+static inline struct ColorRGBA
+mtBlend(struct ColorRGBA a, struct ColorRGBA b)
+{
+	if (a.a == 0)
+		return b;
+	if (a.a == 0xff)
+		return a;
+
+	/* weight of b, premultiplied by the coverage a leaves */
+	unsigned int bw = mtDiv255(b.a * (0xffu - a.a));
+	unsigned int alpha = a.a + bw;
+
+	struct ColorRGBA out;
+	out.r = (unsigned char)((a.r * a.a + b.r * bw + alpha / 2) / alpha);
+	out.g = (unsigned char)((a.g * a.a + b.g * bw + alpha / 2) / alpha);
+	out.b = (unsigned char)((a.b * a.a + b.b * bw + alpha / 2) / alpha);
+	out.a = (unsigned char)alpha;
+
+	return out;
+}
+
+#ifdef __SSE2__
+/* src over dst for 16-bit lanes when dst is opaque: mtDiv255(s * a +
+ * d * (255 - a)) with the pixel alpha broadcast to its 4 channels */
+static inline __m128i
+blendOpaque16(__m128i s, __m128i d)
+{
+	const __m128i k255 = _mm_set1_epi16(0xff), k128 = _mm_set1_epi16(128);
+	__m128i a = _mm_shufflelo_epi16(s, 0xff);
+	a = _mm_shufflehi_epi16(a, 0xff);
+	__m128i x = _mm_add_epi16(
+		_mm_mullo_epi16(s, a),
+		_mm_mullo_epi16(d, _mm_sub_epi16(k255, a)));
+	x = _mm_add_epi16(x, k128);
+	return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+#endif
+
+#ifdef __AVX2__
+static inline __m256i
+blendOpaque16x2(__m256i s, __m256i d)
+{
+	const __m256i k255 = _mm256_set1_epi16(0xff);
+	const __m256i k128 = _mm256_set1_epi16(128);
+	__m256i a = _mm256_shufflelo_epi16(s, 0xff);
+	a = _mm256_shufflehi_epi16(a, 0xff);
+	__m256i x = _mm256_add_epi16(
+		_mm256_mullo_epi16(s, a),
+		_mm256_mullo_epi16(d, _mm256_sub_epi16(k255, a)));
+	x = _mm256_add_epi16(x, k128);
+	return _mm256_srli_epi16(
+		_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+#endif
+
+/* blends n pixels of src over dst. groups of fully transparent source
+ * pixels are skipped, fully opaque ones are stored and groups over an opaque
+ * dst are blended in simd. everything else goes through mtBlend */
+static inline void
+blendRow(struct ColorRGBA *dst, const struct ColorRGBA *src, size_t n)
+{
+	size_t i = 0;
+#ifdef __AVX2__
+	const __m256i amask8 = _mm256_set1_epi32((int)0xff000000);
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256i s = _mm256_loadu_si256((const void *)(src + i));
+		__m256i sa = _mm256_and_si256(s, amask8);
+		if (_mm256_testz_si256(s, amask8))
+			continue;
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(sa, amask8)) == -1)
+		{
+			_mm256_storeu_si256((void *)(dst + i), s);
+			continue;
+		}
+
+		__m256i d = _mm256_loadu_si256((const void *)(dst + i));
+		__m256i da = _mm256_and_si256(d, amask8);
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(da, amask8)) != -1)
+		{
+			for (size_t j = i; j < i + 8; j++)
+				dst[j] = mtBlend(src[j], dst[j]);
+			continue;
+		}
+
+		const __m256i zero = _mm256_setzero_si256();
+		__m256i lo = blendOpaque16x2(_mm256_unpacklo_epi8(s, zero),
+					     _mm256_unpacklo_epi8(d, zero));
+		__m256i hi = blendOpaque16x2(_mm256_unpackhi_epi8(s, zero),
+					     _mm256_unpackhi_epi8(d, zero));
+		__m256i out = _mm256_packus_epi16(lo, hi);
+		_mm256_storeu_si256((void *)(dst + i),
+				    _mm256_or_si256(out, amask8));
+	}
+#endif
+#ifdef __SSE2__
+	const __m128i amask = _mm_set1_epi32((int)0xff000000);
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128i s = _mm_loadu_si128((const void *)(src + i));
+		__m128i sa = _mm_and_si128(s, amask);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(sa, zero)) == 0xffff)
+			continue;
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(sa, amask)) == 0xffff)
+		{
+			_mm_storeu_si128((void *)(dst + i), s);
+			continue;
+		}
+
+		__m128i d = _mm_loadu_si128((const void *)(dst + i));
+		__m128i da = _mm_and_si128(d, amask);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(da, amask)) != 0xffff)
+		{
+			for (size_t j = i; j < i + 4; j++)
+				dst[j] = mtBlend(src[j], dst[j]);
+			continue;
+		}
+
+		__m128i lo = blendOpaque16(_mm_unpacklo_epi8(s, zero),
+					   _mm_unpacklo_epi8(d, zero));
+		__m128i hi = blendOpaque16(_mm_unpackhi_epi8(s, zero),
+					   _mm_unpackhi_epi8(d, zero));
+		__m128i out = _mm_or_si128(_mm_packus_epi16(lo, hi), amask);
+		_mm_storeu_si128((void *)(dst + i), out);
+	}
+#endif
+	for (; i < n; i++)
+		dst[i] = mtBlend(src[i], dst[i]);
+}
+
+/* blends the part of drw tile tx, ty inside r into img and clears it */
+static inline void
+commitTile(struct Image img, struct Image drw, int tx, int ty, struct Recti r)
+{
+	struct Tile *dt = &drw.tiles[tx + ty * drw.tw];
+	if (dt->data == NULL && dt->fill.a == 0)
+		return;
+
+	struct Recti tr = imgTileRect(drw, tx, ty);
+	struct Recti part = rectIntersect(r, tr);
+	struct ColorRGBA *src = tileData(dt);
+	struct ColorRGBA *dst = tileData(&img.tiles[tx + ty * img.tw]);
+	size_t n = (size_t)part.size.x;
+	int y1 = part.pos.y + part.size.y;
+	for (int y = part.pos.y; y < y1; y++)
+	{
+		size_t off = tileOffset(part.pos.x, y);
+		blendRow(dst + off, src + off, n);
+	}
+
+	if (rectEqual(part, tr))
+	{
+		tileSetFill(dt, (struct ColorRGBA){0, 0, 0, 0});
+		return;
+	}
+	for (int y = part.pos.y; y < y1; y++)
+		memset(src + tileOffset(part.pos.x, y), 0, n * sizeof *src);
+}
+
+/* blends the r region of drw into img and clears it in drw. empty drw tiles
+ * are skipped and fully covered ones are freed */
+static inline void
+commitDraw(struct Image img, struct Image drw, struct Recti r)
+{
+	r = rectClip(r, drw.w, drw.h);
+	if (rectEmpty(r))
+		return;
+
+	TILES_IN(r, tx0, ty0, tx1, ty1);
+	for (int ty = ty0; ty <= ty1; ty++)
+		for (int tx = tx0; tx <= tx1; tx++)
+			commitTile(img, drw, tx, ty, r);
+}
+
+/* returns the filled region. tiles covered by r become uniform */
+static inline struct Recti
+imageFill(struct Image i, struct Recti r, struct ColorRGBA c)
+{
+	r = rectClip(r, i.w, i.h);
+	if (rectEmpty(r))
+		return r;
+
+	TILES_IN(r, tx0, ty0, tx1, ty1);
+	for (int ty = ty0; ty <= ty1; ty++)
+		for (int tx = tx0; tx <= tx1; tx++)
+		{
+			struct Recti tr = imgTileRect(i, tx, ty);
+			struct Recti part = rectIntersect(r, tr);
+			if (rectEqual(part, tr))
+			{
+				tileSetFill(&i.tiles[tx + ty * i.tw], c);
+				continue;
+			}
+
+			int x1 = part.pos.x + part.size.x;
+			int y1 = part.pos.y + part.size.y;
+			for (int y = part.pos.y; y < y1; y++)
+				imgSpan(i, part.pos.x, x1, y, c);
+		}
+	return r;
+}
+
+/* sets the pixel x, y, which must lie inside img */
+static inline void
+imgSet(struct Image img, int x, int y, struct ColorRGBA c)
+{
+	tileData(imgTile(img, x, y))[tileOffset(x, y)] = c;
+}
+
+enum BrushShape {
+	BRUSH_SQUARE,
+	BRUSH_ROUND,
+};
+
+/* a brush stamp as one span per row. row j of a stamp on pixel x, y covers
+ * x + lo[j] to x + hi[j] (exclusive) of row y + top + j. the stamp is only
+ * rebuilt when the shape or size changes */
+struct Brush {
+	enum BrushShape shape;
+	int n, top;
+	int *lo, *hi;
+	/* spans of the stroke being rasterized */
+	int *rowLo, *rowHi;
+	size_t rowCap;
+};
+
+static inline void
+brushGrow(int **a, int **b, size_t n)
+{
+	int *na = realloc(*a, n * sizeof *na);
+	if (na != NULL)
+		*a = na;
+	int *nb = realloc(*b, n * sizeof *nb);
+	if (nb != NULL)
+		*b = nb;
+	if (na == NULL || nb == NULL)
+	{
+		perror("realloc failed");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* size is half the width of the stamp, which is (int)(size * 2) pixels */
+static inline void
+brushSet(struct Brush *b, enum BrushShape shape, double size)
+{
+	int n = MAX((int)(size * 2), 0), r = (int)size;
+	if (b->lo != NULL && b->shape == shape && b->n == n)
+		return;
+
+	brushGrow(&b->lo, &b->hi, (size_t)MAX(n, 1));
+	b->shape = shape;
+	b->n = n;
+	b->top = -r;
+
+	/* center of the stamp relative to the pixel it is on */
+	double o = n / 2.0 - r;
+	for (int j = 0; j < n; j++)
+	{
+		if (shape == BRUSH_SQUARE)
+		{
+			b->lo[j] = -r;
+			b->hi[j] = n - r;
+			continue;
+		}
+
+		/* pixels whose centers lie inside the circle */
+		double dy = j - r + 0.5 - o;
+		double hw = sqrt(MAX(n * n / 4.0 - dy * dy, 0));
+		b->lo[j] = (int)ceil(o - hw - 0.5);
+		b->hi[j] = (int)floor(o + hw - 0.5) + 1;
+	}
+}
+
+static inline void
+brushFree(struct Brush *b)
+{
+	free(b->lo);
+	free(b->hi);
+	free(b->rowLo);
+	free(b->rowHi);
+	*b = (struct Brush){0};
+}
+
+/* the region a stroke from v0 to v1 may write to, anti-aliased or not */
+static inline struct Recti
+strokeRect(struct Image img,
+	   const struct Brush *b,
+	   struct Vec2i v0,
+	   struct Vec2i v1)
+{
+	if (b->n <= 0)
+		return (struct Recti){{0, 0}, {0, 0}};
+
+	struct Recti r = {{MIN(v0.x, v1.x) + b->top - 1,
+			   MIN(v0.y, v1.y) + b->top - 1},
+			  {abs(v1.x - v0.x) + b->n + 2,
+			   abs(v1.y - v0.y) + b->n + 2}};
+	return rectClip(r, img.w, img.h);
+}
+
+/* a / b rounded to the nearest integer, b > 0 */
+static inline int
+mtDivRound(long long a, long long b)
+{
+	if (a < 0)
+		return -mtDivRound(-a, b);
+	return (int)((a * 2 + b) / (b * 2));
+}
+
+/* pixel of step i of count along a line from v0 going d */
+static inline struct Vec2i
+strokeStep(struct Vec2i v0, struct Vec2i d, int i, int count)
+{
+	if (count == 0)
+		return v0;
+	return (struct Vec2i){v0.x + mtDivRound((long long)d.x * i, count),
+			      v0.y + mtDivRound((long long)d.y * i, count)};
+}
+
+/* widens the rows covered by stamps on row y from x0 to x1 */
+static inline void
+brushRun(struct Brush *b, int y, int x0, int x1)
+{
+	for (int j = 0; j < b->n; j++)
+	{
+		int row = y + j;
+		b->rowLo[row] = MIN(b->rowLo[row], x0 + b->lo[j]);
+		b->rowHi[row] = MAX(b->rowHi[row], x1 + b->hi[j]);
+	}
+}
+
+/* stamps b along the line from v0 to v1. the union of the stamps is found
+ * as one span per row first, so every pixel is written once */
+static inline void
+strokeSpans(struct Image write,
+	    struct Brush *b,
+	    struct ColorRGBA color,
+	    struct Vec2i v0,
+	    struct Vec2i v1)
+{
+	struct Vec2i d = {v1.x - v0.x, v1.y - v0.y};
+	int count = MAX(abs(d.x), abs(d.y));
+	int base = MIN(v0.y, v1.y);
+	size_t rows = (size_t)abs(d.y) + (size_t)b->n;
+	if (rows > b->rowCap)
+	{
+		brushGrow(&b->rowLo, &b->rowHi, rows);
+		b->rowCap = rows;
+	}
+	for (size_t i = 0; i < rows; i++)
+	{
+		b->rowLo[i] = write.w;
+		b->rowHi[i] = 0;
+	}
+
+	/* neighbouring stamps on the same row only move sideways, so a run
+	 * of them widens the rows it covers once */
+	struct Vec2i run = v0;
+	int runX0 = v0.x, runX1 = v0.x;
+	for (int i = 1; i <= count; i++)
+	{
+		struct Vec2i p = strokeStep(v0, d, i, count);
+		if (p.y == run.y)
+		{
+			runX0 = MIN(runX0, p.x);
+			runX1 = MAX(runX1, p.x);
+			continue;
+		}
+		brushRun(b, run.y - base, runX0, runX1);
+		run = p;
+		runX0 = runX1 = p.x;
+	}
+	brushRun(b, run.y - base, runX0, runX1);
+
+	for (size_t i = 0; i < rows; i++)
+	{
+		int y = base + b->top + (int)i;
+		int x0 = MAX(b->rowLo[i], 0), x1 = MIN(b->rowHi[i], write.w);
+		if (y >= 0 && y < write.h)
+			imgSpan(write, x0, x1, y, color);
+	}
+}
+
+/* the pixels of row py whose centers lie within rad of the segment a, b,
+ * as [*x0, *x1). the capsule is convex, so that is a single span made of
+ * the spans of both end circles & of the band between them */
+static inline void
+capsuleRow(double ax,
+	   double ay,
+	   double bx,
+	   double by,
+	   double rad,
+	   int py,
+	   int *x0,
+	   int *x1)
+{
+	double l = HUGE_VAL, r = -HUGE_VAL;
+	double y = py + 0.5;
+	double ends[2][2] = {{ax, ay}, {bx, by}};
+	for (int i = 0; i < 2; i++)
+	{
+		double dy = y - ends[i][1];
+		if (fabs(dy) > rad)
+			continue;
+		double hw = sqrt(rad * rad - dy * dy);
+		l = MIN(l, ends[i][0] - hw);
+		r = MAX(r, ends[i][0] + hw);
+	}
+
+	double len = hypot(bx - ax, by - ay);
+	if (len > 0)
+	{
+		/* 0 <= q . u <= len & |q x u| <= rad, with q = p - a */
+		double ux = (bx - ax) / len, uy = (by - ay) / len;
+		double qy = y - ay;
+		double bl = -HUGE_VAL, br = HUGE_VAL;
+		if (ux != 0)
+		{
+			double e0 = -qy * uy / ux, e1 = (len - qy * uy) / ux;
+			bl = MAX(bl, MIN(e0, e1));
+			br = MIN(br, MAX(e0, e1));
+		} else if (qy * uy < 0 || qy * uy > len)
+			br = -HUGE_VAL;
+		if (uy != 0)
+		{
+			double e0 = (qy * ux - rad) / uy;
+			double e1 = (qy * ux + rad) / uy;
+			bl = MAX(bl, MIN(e0, e1));
+			br = MIN(br, MAX(e0, e1));
+		} else if (fabs(qy * ux) > rad)
+			br = -HUGE_VAL;
+		if (bl <= br)
+		{
+			l = MIN(l, ax + bl);
+			r = MAX(r, ax + br);
+		}
+	}
+
+	if (l > r)
+	{
+		*x0 = *x1 = 0;
+		return;
+	}
+	*x0 = (int)ceil(l - 0.5);
+	*x1 = (int)floor(r - 0.5) + 1;
+}
+
+static inline double
+mtSegmentDist(double px, double py, double ax, double ay, double bx, double by)
+{
+	double dx = bx - ax, dy = by - ay;
+	double len2 = dx * dx + dy * dy;
+	double t = len2 > 0 ? ((px - ax) * dx + (py - ay) * dy) / len2 : 0;
+	t = t < 0 ? 0 : t > 1 ? 1 : t;
+	return hypot(px - ax - t * dx, py - ay - t * dy);
+}
+
+/* round stroke with coverage in the alpha channel. pixels the stroke only
+ * partly covers keep the most coverage written to them, so the segments of
+ * a stroke join without seams */
+static inline void
+strokeCapsuleAA(struct Image write,
+		const struct Brush *b,
+		struct ColorRGBA color,
+		struct Vec2i v0,
+		struct Vec2i v1)
+{
+	double o = b->n / 2.0 + b->top, rad = b->n / 2.0;
+	double ax = v0.x + o, ay = v0.y + o, bx = v1.x + o, by = v1.y + o;
+	struct Recti r = strokeRect(write, b, v0, v1);
+
+	for (int y = r.pos.y; y < r.pos.y + r.size.y; y++)
+	{
+		int out0, out1, in0, in1;
+		capsuleRow(ax, ay, bx, by, rad + 0.5, y, &out0, &out1);
+		capsuleRow(ax, ay, bx, by, rad - 0.5, y, &in0, &in1);
+		out0 = MAX(out0, 0);
+		out1 = MIN(out1, write.w);
+		in0 = MIN(MAX(in0, out0), out1);
+		in1 = MAX(MIN(in1, out1), in0);
+
+		for (int x = out0; x < out1; x++)
+		{
+			if (x == in0 && in0 < in1)
+			{
+				imgSpan(write, in0, in1, y, color);
+				x = in1 - 1;
+				continue;
+			}
+
+			double dist =
+				mtSegmentDist(x + 0.5, y + 0.5, ax, ay, bx, by);
+			double cov = rad + 0.5 - dist;
+			cov = cov < 0 ? 0 : cov > 1 ? 1 : cov;
+			struct ColorRGBA c = color;
+			c.a = (unsigned char)(color.a * cov + 0.5);
+			if (c.a > imgGet(write, x, y).a)
+				imgSet(write, x, y, c);
+		}
+	}
+}
+
+/* draws a stroke of b from v0 to v1. aa only applies to round brushes.
+ * returns the region that may have been written to */
+static inline struct Recti
+strokeBrush(struct Image write,
+	    struct Brush *b,
+	    struct ColorRGBA color,
+	    bool aa,
+	    struct Vec2i v0,
+	    struct Vec2i v1)
+{
+	if (b->n <= 0)
+		return (struct Recti){{0, 0}, {0, 0}};
+
+	if (aa && b->shape == BRUSH_ROUND)
+		strokeCapsuleAA(write, b, color, v0, v1);
+	else
+		strokeSpans(write, b, color, v0, v1);
+	return strokeRect(write, b, v0, v1);
+}
+
+static inline void
+sampleImg(struct Image i, int x, int y, struct ColorRGBA *out)
+{
+	if (x >= 0 && x < i.w && y >= 0 && y < i.h)
+		*out = imgGet(i, x, y);
+}
+
+/* the contents of tile index before an edit, or after it once undone */
+struct TileSave {
+	size_t index;
+	struct Tile tile;
+};
+
+struct HistEntry {
+	struct TileSave *saves;
+	size_t n, cap;
+};
+
+/* undo history. entries [0, cur) can be undone, [cur, n) redone */
+struct History {
+	struct HistEntry *entries;
+	size_t n, cur, cap;
+	/* bytes of tile pixels held by all entries & the most to keep */
+	size_t bytes, budget;
+	/* generation each tile was last saved in, to save it once per edit */
+	unsigned int *saved;
+	unsigned int gen;
+	/* whether an edit is open & has an entry yet, see histEntry */
+	bool open, added;
+};
+
+static inline bool
+histInit(struct History *h, struct Image img, size_t budget)
+{
+	*h = (struct History){0};
+	h->budget = budget;
+	h->saved = calloc((size_t)img.tw * (size_t)img.th, sizeof *h->saved);
+	return h->saved != NULL;
+}
+
+static inline size_t
+histEntryBytes(struct HistEntry *e)
+{
+	size_t bytes = 0;
+	for (size_t i = 0; i < e->n; i++)
+		if (e->saves[i].tile.data != NULL)
+			bytes += TILE_PIXELS * sizeof *e->saves[i].tile.data;
+	return bytes;
+}
+
+static inline void
+histEntryFree(struct HistEntry *e)
+{
+	for (size_t i = 0; i < e->n; i++)
+		if (!e->saves[i].tile.shared)
+			free(e->saves[i].tile.data);
+	free(e->saves);
+}
+
+static inline void
+histFree(struct History *h)
+{
+	for (size_t i = 0; i < h->n; i++)
+		histEntryFree(&h->entries[i]);
+	free(h->entries);
+	free(h->saved);
+	*h = (struct History){0};
+}
+
+/* starts an edit. what could be redone stays until it saves a tile */
+static inline void
+histBegin(struct History *h)
+{
+	h->gen++;
+	h->open = true;
+	h->added = false;
+}
+
+/* the entry of the open edit, added with its first tile. that drops
+ * everything that could be redone, so edits that change nothing keep it */
+static inline struct HistEntry *
+histEntry(struct History *h)
+{
+	if (h->added)
+		return &h->entries[h->n - 1];
+
+	while (h->n > h->cur)
+	{
+		h->n--;
+		h->bytes -= histEntryBytes(&h->entries[h->n]);
+		histEntryFree(&h->entries[h->n]);
+	}
+
+	if (h->n == h->cap)
+	{
+		size_t cap = h->cap ? h->cap * 2 : 16;
+		struct HistEntry *e = realloc(h->entries, cap * sizeof *e);
+		if (e == NULL)
+		{
+			perror("realloc failed");
+			exit(EXIT_FAILURE);
+		}
+		h->entries = e;
+		h->cap = cap;
+	}
+
+	h->entries[h->n++] = (struct HistEntry){0};
+	h->cur = h->n;
+	h->added = true;
+	return &h->entries[h->n - 1];
+}
+
+/* saves the tiles of img overlapping r that the open edit has not saved
+ * yet. if only is given, tiles that are empty in it are skipped */
+static inline void
+histSave(struct History *h,
+	 struct Image img,
+	 struct Recti r,
+	 const struct Image *only)
+{
+	r = rectClip(r, img.w, img.h);
+	if (!h->open || rectEmpty(r))
+		return;
+
+	TILES_IN(r, tx0, ty0, tx1, ty1);
+	for (int ty = ty0; ty <= ty1; ty++)
+		for (int tx = tx0; tx <= tx1; tx++)
+		{
+			size_t i = (size_t)tx + (size_t)ty * (size_t)img.tw;
+			if (h->saved[i] == h->gen)
+				continue;
+			if (only != NULL && only->tiles[i].data == NULL &&
+			    only->tiles[i].fill.a == 0)
+				continue;
+			h->saved[i] = h->gen;
+
+			struct HistEntry *e = histEntry(h);
+			if (e->n == e->cap)
+			{
+				size_t cap = e->cap ? e->cap * 2 : 8;
+				struct TileSave *s =
+					realloc(e->saves, cap * sizeof *s);
+				if (s == NULL)
+				{
+					perror("realloc failed");
+					exit(EXIT_FAILURE);
+				}
+				e->saves = s;
+				e->cap = cap;
+			}
+
+			struct Tile t = img.tiles[i];
+			if (t.data != NULL)
+			{
+				t.data = malloc(TILE_PIXELS * sizeof *t.data);
+				if (t.data == NULL)
+				{
+					perror("malloc failed");
+					exit(EXIT_FAILURE);
+				}
+				memcpy(t.data,
+				       img.tiles[i].data,
+				       TILE_PIXELS * sizeof *t.data);
+				h->bytes += TILE_PIXELS * sizeof *t.data;
+				t.shared = false;
+			}
+			e->saves[e->n++] = (struct TileSave){i, t};
+		}
+}
+
+/* closes the edit and evicts the oldest entries over the budget */
+static inline void
+histEnd(struct History *h)
+{
+	if (!h->open)
+		return;
+	h->open = false;
+	if (!h->added)
+		return;
+
+	size_t drop = 0;
+	while (h->bytes > h->budget && drop + 1 < h->n)
+	{
+		h->bytes -= histEntryBytes(&h->entries[drop]);
+		histEntryFree(&h->entries[drop]);
+		drop++;
+	}
+	memmove(h->entries,
+		h->entries + drop,
+		(h->n - drop) * sizeof *h->entries);
+	h->n -= drop;
+	h->cur -= drop;
+}
+
+/* swaps the tiles of e with the ones in img, which turns an undo entry into
+ * a redo entry & back. returns the region that changed */
+static inline struct Recti
+histSwap(struct History *h, struct HistEntry *e, struct Image img)
+{
+	struct Recti r = {{0, 0}, {0, 0}};
+	h->bytes -= histEntryBytes(e);
+	for (size_t i = 0; i < e->n; i++)
+	{
+		struct TileSave *s = &e->saves[i];
+		struct Tile t = img.tiles[s->index];
+		img.tiles[s->index] = s->tile;
+		s->tile = t;
+
+		int tx = (int)(s->index % (size_t)img.tw);
+		int ty = (int)(s->index / (size_t)img.tw);
+		r = rectUnion(r, imgTileRect(img, tx, ty));
+	}
+	h->bytes += histEntryBytes(e);
+	return r;
+}
+
+static inline struct Recti
+histUndo(struct History *h, struct Image img)
+{
+	if (h->open || h->cur == 0)
+		return (struct Recti){{0, 0}, {0, 0}};
+	return histSwap(h, &h->entries[--h->cur], img);
+}
+
+static inline struct Recti
+histRedo(struct History *h, struct Image img)
+{
+	if (h->open || h->cur == h->n)
+		return (struct Recti){{0, 0}, {0, 0}};
+	return histSwap(h, &h->entries[h->cur++], img);
+}
+
+/* copies the tile table of img to snap, sharing the pixels. img & its
+ * history copy a tile before changing it, so snap keeps the pixels img had
+ * until imgUnshare */
+static inline bool
+imgShare(struct Image img, struct Image *snap)
+{
+	size_t n = (size_t)img.tw * (size_t)img.th;
+	*snap = img;
+	snap->tiles = malloc(n * sizeof *snap->tiles);
+	if (snap->tiles == NULL)
+		return false;
+	for (size_t i = 0; i < n; i++)
+	{
+		img.tiles[i].shared = img.tiles[i].data != NULL;
+		snap->tiles[i] = img.tiles[i];
+		snap->tiles[i].shared = false;
+	}
+	return true;
+}
+
+/* frees snap. pixels still shared with img or h are theirs alone again, the
+ * rest were dropped by them & are freed. a shared tile never changes its
+ * index, so snap holds its pixels at the same index */
+static inline void
+imgUnshare(struct Image img, struct History *h, struct Image *snap)
+{
+	for (size_t i = 0; i < (size_t)img.tw * (size_t)img.th; i++)
+		if (img.tiles[i].shared)
+		{
+			img.tiles[i].shared = false;
+			snap->tiles[i].data = NULL;
+		}
+	for (size_t e = 0; e < h->n; e++)
+		for (size_t i = 0; i < h->entries[e].n; i++)
+		{
+			struct TileSave *s = &h->entries[e].saves[i];
+			if (s->tile.shared)
+			{
+				s->tile.shared = false;
+				snap->tiles[s->index].data = NULL;
+			}
+		}
+	imgFree(snap);
+}
@@ -1,8 +1,26 @@
+#include <stddef.h>
 #include <stdint.h>
 
+/* messages are a struct Msg, followed by msgPayload(id) bytes */
 enum MsgType {
 	MSG_GET_COLOR,
 	MSG_SET_COLOR,
+	/* followed by a MsgRect. the pixels travel through a memfd of
+	 * w * h RGBA pixels sealed with F_SEAL_SHRINK, sent along with the
+	 * message with SCM_RIGHTS. pie only holds a few memfds whose
+	 * messages have not arrived whole. getting replies with the MsgRect
+	 * that was copied, clipped to the canvas */
+	MSG_GET_REGION,
+	MSG_PUT_REGION,
+	/* followed by a MsgRect to fill with data.color */
+	MSG_FILL_RECT,
+	/* followed by a MsgStroke to draw with data.color & the brush */
+	MSG_STROKE,
+	/* sent with an fd, like the memfds of regions, to write the image to
+	 * as farbfeld. the image is saved as it is when the message runs,
+	 * while editing goes on. replies with a uint64_t once the save is
+	 * done, 1 if the whole image was written & 0 otherwise */
+	MSG_SAVE,
 };
 
 union MsgData {
@@ -14,3 +32,27 @@ struct Msg {
 	uint64_t id;
 	union MsgData data;
 };
+
+struct MsgRect {
+	int32_t x, y, w, h;
+};
+
+struct MsgStroke {
+	int32_t x0, y0, x1, y1;
+};
+
+static inline size_t
+msgPayload(uint64_t id)
+{
+	switch (id)
+	{
+	case MSG_GET_REGION:
+	case MSG_PUT_REGION:
+	case MSG_FILL_RECT:
+		return sizeof(struct MsgRect);
+	case MSG_STROKE:
+		return sizeof(struct MsgStroke);
+	default:
+		return 0;
+	}
+}
@@ -3,14 +3,23 @@
  * this file is part of pie
  * see LICENSE file for the license text */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <math.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #define WIN_TITLE "pcp"
 #define WINW 300
 #define WINH 332
 
 #include "common.h"
+#include "msg.h"
 
 enum SelectionType { SEL_NONE, SEL_HSV_WHEEL, SEL_VAL_BAR };
 
@@ -19,14 +28,12 @@ struct ColorHSV {
 };
 
 struct HSVWheel {
-	struct ImgShader sh;
 	struct Rect r;
 	struct Vec2f pos;
 	struct ColorHSV c;
 };
 
 struct ValueBar {
-	struct ImgShader sh;
 	struct Rect r;
 	double v;
 };
@@ -34,9 +41,16 @@ struct ValueBar {
 struct pcp {
 	struct HSVWheel hsvWheel;
 	struct ValueBar valBar;
-	struct ColorRGBA color;
-	bool m0Down, quit;
+	struct ColorRGBA color, sent;
+	bool m0Down, quit, hidden, redraw;
+	/* the wheel & the value bar, rendered once at startup */
+	struct ImgShader bakedSh;
+	unsigned int baked;
 	enum SelectionType selection;
+	/* connection to pie, or -1 when printing the color on exit */
+	int sock;
+	/* set by the signal thread when pie asks to show the picker */
+	int show;
 };
 
 static const char *hsvWheelFragSrc =
@@ -64,6 +78,16 @@ static const char *valBarFragSrc = "#version 330 core\n"
 				   "FragColor = vec4(texCoord.xxx, 1);"
 				   "}";
 
+/* framebuffer rows go bottom up, the quad's texCoord top down */
+static const char *bakedFragSrc =
+	"#version 330 core\n"
+	"in vec2 texCoord;"
+	"out vec4 FragColor;"
+	"uniform sampler2D tex;"
+	"void main() {"
+	"FragColor = texture(tex, vec2(texCoord.x, 1 - texCoord.y));"
+	"}";
+
 #define PI 3.14159265358979
 
 #define UI_VAL_HEIGHT 32
@@ -98,6 +122,63 @@ grDrawImage(unsigned int shader)
 	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
 }
 
+/* renders the wheel & the value bar into a texture, so frames only copy
+ * it instead of running the wheel shader on every pixel */
+static void
+grBake(struct pcp *pcp)
+{
+	struct ImgShader wheel, bar;
+	grImgInitGr(&wheel, hsvWheelFragSrc);
+	grImgUpdate(&wheel, pcp->hsvWheel.r, WINW, WINH);
+	grImgInitGr(&bar, valBarFragSrc);
+	grImgUpdate(&bar, pcp->valBar.r, WINW, WINH);
+
+	glGenTextures(1, &pcp->baked);
+	glBindTexture(GL_TEXTURE_2D, pcp->baked);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D,
+		     0,
+		     GL_RGBA8,
+		     WINW,
+		     WINH,
+		     0,
+		     GL_RGBA,
+		     GL_UNSIGNED_BYTE,
+		     NULL);
+
+	unsigned int fbo;
+	glGenFramebuffers(1, &fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER,
+			       GL_COLOR_ATTACHMENT0,
+			       GL_TEXTURE_2D,
+			       pcp->baked,
+			       0);
+	int viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	glViewport(0, 0, WINW, WINH);
+	/* the transparent outside of the wheel shows the picked color */
+	glDisable(GL_BLEND);
+	glClearColor(0, 0, 0, 0);
+	glClear(GL_COLOR_BUFFER_BIT);
+	grDrawImage(wheel.id);
+	grDrawImage(bar.id);
+	glEnable(GL_BLEND);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+	glDeleteFramebuffers(1, &fbo);
+	glDeleteProgram(wheel.id);
+	glDeleteProgram(bar.id);
+
+	grImgInitGr(&pcp->bakedSh, bakedFragSrc);
+	grImgUpdate(&pcp->bakedSh,
+		    (struct Rect){{0, 0}, {WINW, WINH}},
+		    WINW,
+		    WINH);
+}
+
 static void
 grDrawMark(struct Vec2f pos, struct Vec2f win)
 {
@@ -115,6 +196,30 @@ grDrawMark(struct Vec2f pos, struct Vec2f win)
 	glEnd();
 }
 
+static void
+grDraw(struct pcp *pcp, GLFWwindow *window)
+{
+	glClearColor(pcp->color.r / 255.f,
+		     pcp->color.g / 255.f,
+		     pcp->color.b / 255.f,
+		     1);
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	glBindTexture(GL_TEXTURE_2D, pcp->baked);
+	grDrawImage(pcp->bakedSh.id);
+
+	glUseProgram(0);
+	glColor3ub(0, 0, 0);
+	grDrawMark(pcp->hsvWheel.pos, (struct Vec2f){WINW, WINH});
+	glColor3ub(0xff, 0, 0);
+	struct Vec2f markPos = {pcp->valBar.v * WINW,
+				WINH - UI_VAL_HEIGHT / 2.};
+	grDrawMark(markPos, (struct Vec2f){WINW, WINH});
+
+	glfwSwapBuffers(window);
+	pcp->redraw = false;
+}
+
 static struct ColorHSV
 HSVWheelAt(struct Vec2f pos)
 {
@@ -163,6 +268,7 @@ mouseDown(struct pcp *pcp, GLFWwindow *window)
 	struct ColorHSV hsv = {
 		pcp->hsvWheel.c.h, pcp->hsvWheel.c.s, pcp->valBar.v};
 	pcp->color = mtHSV2RGBA(hsv);
+	pcp->redraw = true;
 }
 
 static void
@@ -193,6 +299,22 @@ cbMouse(GLFWwindow *window, int button, int action, int mod)
 		pcp->selection = SEL_VAL_BAR;
 }
 
+/* ends the picker, or hides it when it stays running for pie */
+static void
+confirm(struct pcp *pcp, GLFWwindow *window)
+{
+	if (pcp->sock == -1)
+	{
+		pcp->quit = true;
+		return;
+	}
+	glfwSetWindowShouldClose(window, false);
+	glfwHideWindow(window);
+	pcp->hidden = true;
+	pcp->m0Down = false;
+	pcp->selection = SEL_NONE;
+}
+
 static void
 cbKeyboard(GLFWwindow *window, int key, int scan, int action, int mod)
 {
@@ -200,66 +322,178 @@ cbKeyboard(GLFWwindow *window, int key, int scan, int action, int mod)
 	glfwMakeContextCurrent(window);
 	struct pcp *pcp = glfwGetWindowUserPointer(window);
 	if (key == KEY_CONFIRM && action != GLFW_RELEASE)
+		confirm(pcp, window);
+}
+
+static void
+cbRefresh(GLFWwindow *window)
+{
+	struct pcp *pcp = glfwGetWindowUserPointer(window);
+	pcp->redraw = true;
+}
+
+static int
+sockConnect(const char *path)
+{
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+	{
+		perror("socket failed");
+		return -1;
+	}
+	struct sockaddr_un addr = {0};
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof addr.sun_path - 1);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof addr) == -1)
+	{
+		perror("connect failed");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* starts from the color of pie, so only picking one changes it. quits once
+ * pie is gone */
+static void
+fetchColor(struct pcp *pcp)
+{
+	struct Msg m = {MSG_GET_COLOR, {0}};
+	struct ColorRGBA color;
+	if (send(pcp->sock, &m, sizeof m, MSG_NOSIGNAL) != sizeof m ||
+	    recv(pcp->sock, &color, sizeof color, MSG_WAITALL) != sizeof color)
+	{
+		fprintf(stderr, "failed to get the color of pie\n");
+		pcp->quit = true;
+		return;
+	}
+	pcp->color = color;
+	pcp->sent = color;
+	pcp->redraw = true;
+}
+
+/* sends the color to pie if it changed. quits once pie is gone */
+static void
+sendColor(struct pcp *pcp)
+{
+	if (memcmp(&pcp->color, &pcp->sent, sizeof pcp->color) == 0)
+		return;
+	struct Msg m = {MSG_SET_COLOR, {0}};
+	m.data.color = pcp->color;
+	if (send(pcp->sock, &m, sizeof m, MSG_NOSIGNAL) != sizeof m)
+	{
+		perror("send failed");
 		pcp->quit = true;
+	}
+	pcp->sent = pcp->color;
+}
+
+/* waits for SIGUSR1, which pie sends to show the picker again */
+static void *
+signalRun(void *data)
+{
+	struct pcp *pcp = data;
+	sigset_t usr1;
+	sigemptyset(&usr1);
+	sigaddset(&usr1, SIGUSR1);
+	for (;;)
+	{
+		int sig;
+		if (sigwait(&usr1, &sig) != 0)
+			continue;
+		__sync_lock_test_and_set(&pcp->show, 1);
+		glfwPostEmptyEvent();
+	}
+	return NULL;
 }
 
 int
-main(void)
+main(int argc, char **argv)
 {
 	struct pcp pcp = {0};
+	pcp.sock = -1;
+
+	/* with the socket of a pie, the picker sets its color directly &
+	 * stays running until pie ends */
+	if (argc > 1 && (pcp.sock = sockConnect(argv[1])) == -1)
+		return EXIT_FAILURE;
+
+	/* blocked before any thread starts, so only signalRun takes it */
+	sigset_t usr1;
+	sigemptyset(&usr1);
+	sigaddset(&usr1, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &usr1, NULL);
 
 	GLFWwindow *window;
 	struct Vec2i win = {WINW, WINH};
 	if (!grInit(&pcp, &window, win, false, cbMouse, cbKeyboard, NULL))
 		return EXIT_FAILURE;
 
+	pthread_t signals;
+	if (pcp.sock != -1 &&
+	    pthread_create(&signals, NULL, signalRun, &pcp) != 0)
+	{
+		fprintf(stderr, "failed to start signal thread\n");
+		return EXIT_FAILURE;
+	}
+
 	unsigned int vao = grImgGenVAO();
 
 	pcp.hsvWheel.r.size = (struct Vec2f){WINW, WINW};
 	pcp.hsvWheel.pos = (struct Vec2f){WINW / 2., WINW / 2.};
-	grImgInitGr(&pcp.hsvWheel.sh, hsvWheelFragSrc);
-	grImgUpdate(&pcp.hsvWheel.sh, pcp.hsvWheel.r, WINW, WINH);
 	pcp.valBar.r.pos = (struct Vec2f){0, WINH - UI_VAL_HEIGHT};
 	pcp.valBar.r.size = (struct Vec2f){WINW, UI_VAL_HEIGHT};
 	pcp.color.a = 0xff;
-	grImgInitGr(&pcp.valBar.sh, valBarFragSrc);
-	grImgUpdate(&pcp.valBar.sh, pcp.valBar.r, WINW, WINH);
+	if (pcp.sock != -1)
+		fetchColor(&pcp);
+	grBake(&pcp);
+	pcp.redraw = true;
+	glfwSetWindowRefreshCallback(window, cbRefresh);
 
-	while (!glfwWindowShouldClose(window) && !pcp.quit)
+	while (!pcp.quit)
 	{
-		glClearColor(pcp.color.r / 255.f,
-			     pcp.color.g / 255.f,
-			     pcp.color.b / 255.f,
-			     1);
-		glClear(GL_COLOR_BUFFER_BIT);
-
-		grDrawImage(pcp.hsvWheel.sh.id);
-		grDrawImage(pcp.valBar.sh.id);
-
-		glUseProgram(0);
-		glColor3ub(0, 0, 0);
-		grDrawMark(pcp.hsvWheel.pos, (struct Vec2f){WINW, WINH});
-		glColor3ub(0xff, 0, 0);
-		struct Vec2f markPos = {pcp.valBar.v * WINW,
-					WINH - UI_VAL_HEIGHT / 2.};
-		grDrawMark(markPos, (struct Vec2f){WINW, WINH});
-
-		glfwSwapBuffers(window);
-		glfwPollEvents();
+		if (__sync_lock_test_and_set(&pcp.show, 0))
+		{
+			fetchColor(&pcp);
+			glfwShowWindow(window);
+			glfwFocusWindow(window);
+			pcp.hidden = false;
+			pcp.redraw = true;
+		}
+		if (pcp.hidden)
+		{
+			glfwWaitEvents();
+			continue;
+		}
+		if (glfwWindowShouldClose(window))
+		{
+			confirm(&pcp, window);
+			continue;
+		}
+
+		/* frames are only drawn when something changed */
+		if (pcp.redraw)
+			grDraw(&pcp, window);
+		glfwWaitEvents();
 
 		if (pcp.m0Down)
 			mouseDown(&pcp, window);
+		if (pcp.sock != -1)
+			sendColor(&pcp);
 	}
 
-	printf("%02x%02x%02x%02x",
-	       pcp.color.r,
-	       pcp.color.g,
-	       pcp.color.b,
-	       pcp.color.a);
+	if (pcp.sock == -1)
+		printf("%02x%02x%02x%02x",
+		       pcp.color.r,
+		       pcp.color.g,
+		       pcp.color.b,
+		       pcp.color.a);
+	else
+		close(pcp.sock);
 
 	glDeleteVertexArrays(1, &vao);
-	glDeleteProgram(pcp.hsvWheel.sh.id);
-	glDeleteProgram(pcp.valBar.sh.id);
+	glDeleteTextures(1, &pcp.baked);
+	glDeleteProgram(pcp.bakedSh.id);
 
 	glfwTerminate();
 
@@ -3,35 +3,126 @@
  * this file is part of pie
  * see LICENSE file for the license text */
 
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
 #include <sys/poll.h>
+#include <sys/prctl.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #define WIN_TITLE "pie"
 
 #include "common.h"
+#include "ff.h"
+#include "img.h"
 #include "msg.h"
+#include "shm.h"
+
+/* number of pixel buffers texture uploads rotate through */
+#define PBO_COUNT 3
+/* side of the textures the canvas is split into. gl 3.3 guarantees
+ * textures this big, & it must be a multiple of TILE_SIZE */
+#define GR_TILE 1024
+#define GR_TILES_IN(r, tx0, ty0, tx1, ty1) \
+	int tx0 = (r).pos.x / GR_TILE, ty0 = (r).pos.y / GR_TILE; \
+	int tx1 = ((r).pos.x + (r).size.x - 1) / GR_TILE; \
+	int ty1 = ((r).pos.y + (r).size.y - 1) / GR_TILE
+/* most cursor positions queued between two frames */
+#define CURSOR_QUEUE 1024
+/* most clients connected at once */
+#define SERVER_CLIENTS 16
+/* bytes buffered per client for messages & for replies. clients that
+ * leave more replies than that unread are dropped */
+#define CLIENT_IN 4096
+#define CLIENT_OUT 65536
+/* most memfds a client may have sent ahead of their messages */
+#define CLIENT_FDS 16
+/* regions are at most this wide & tall & lie at most this far out */
+#define REGION_MAX (1 << 16)
+/* longest line of a headless script */
+#define SCRIPT_LINE 4096
+/* bands of tile rows decoded ahead of the main thread while loading */
+#define LOAD_BANDS 4
+/* longest time in seconds quitting waits for running saves */
+#define SAVE_QUIT_WAIT 5
+
+/* streams texture uploads through pixel buffer objects. fences keep a
+ * buffer from being rewritten while the gpu still reads from it */
+struct Uploader {
+	bool enabled;
+	int next;
+	unsigned int pbo[PBO_COUNT];
+	size_t size[PBO_COUNT];
+	GLsync fence[PBO_COUNT];
+};
 
-struct Image {
-	struct ColorRGBA *data;
-	int w, h;
+/* an image as a grid of GR_TILE textures, row by row. the last row &
+ * column are cut to the image size */
+struct GrTiles {
+	int tw, th;
+	unsigned int *tex;
+};
+
+/* gl objects for painting on the gpu. stamps are instanced quads drawn into
+ * the stroke textures, commits blend through a GR_TILE scratch texture */
+struct GrPaint {
+	unsigned int fbo, scratch, inst;
+	unsigned int stamp, uOrg, uTile, uQuad, uSize, uColor, uShape, uSeg;
+	unsigned int blend, uSrc;
+	/* stamp positions of the segment being drawn */
+	float *pts;
+	size_t cap;
 };
 
 struct Canvas {
 	struct Image img, drw;
+	/* strokes sent through the socket are drawn here, apart from the one
+	 * the user is drawing in drw. empty between messages */
+	struct Image sockDrw;
+	/* regions changed since the last texture upload */
+	struct Recti imgDirty, drwDirty;
+	/* changed regions not uploaded yet because they were out of view */
+	struct Recti imgStale, drwStale;
+	/* region covered by the stroke being drawn, or by strokes waiting
+	 * for their rows to load */
+	struct Recti stroke;
+	/* rows of img loaded so far. edits stay above them */
+	int loaded;
+	/* screen pixels per canvas pixel & where the canvas origin is */
 	double scale;
 	struct Rect r;
-	unsigned int imgTex, drwTex;
-	struct ImgShader sh, bgSh;
+	/* part of the canvas in the window, now & at the last upload */
+	struct Recti vis, upVis;
+	/* keep the canvas fit to the window until zoomed or panned */
+	bool fit;
+	struct History hist;
+	struct GrTiles imgTex, drwTex;
+	struct Uploader up;
+	/* draws the checkerboard, img & optionally drw in one pass */
+	struct ImgShader sh;
+	unsigned int uShowDrw;
 	unsigned int vao;
-};
-
-struct Recti {
-	struct Vec2i pos, size;
+	/* shared memory export of img, if any */
+	struct ShmCanvas *shm;
+	/* paint on the gpu. img is then read back only where the textures
+	 * are ahead of it & something needs it */
+	bool gpu;
+	struct Recti ahead;
+	struct GrPaint paint;
 };
 
 struct Area {
@@ -39,56 +130,283 @@ struct Area {
 	struct Recti r;
 };
 
+/* a persistent connection. messages are read into in & run from inPos,
+ * replies wait in out until the socket takes them */
+struct Client {
+	int fd;
+	/* tells the client apart from later ones in its slot */
+	unsigned long id;
+	bool eof, bad;
+	/* epoll events watched for, see clientWatch */
+	uint32_t events;
+	/* waits for the reply of the save running or queued. the messages
+	 * after it wait too, so replies stay in order */
+	bool saving;
+	unsigned char in[CLIENT_IN];
+	size_t inLen, inPos;
+	unsigned char out[CLIENT_OUT];
+	size_t outLen;
+	/* memfds received, in the order of the messages they belong to */
+	int fds[CLIENT_FDS];
+	size_t nfds;
+};
+
+/* the listening socket & its clients, all watched by one epoll instance.
+ * clients are tagged with their index, the listening socket with
+ * SERVER_CLIENTS */
+struct Server {
+	int fd, epfd;
+	struct Client *clients[SERVER_CLIENTS];
+	unsigned long lastId;
+};
+
+/* wakes the render loop when the socket server has events */
+struct Watcher {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	/* set until the main thread serviced the socket */
+	bool pending;
+	int fd;
+};
+
+/* decodes the input image while the window opens. the main thread copies
+ * finished bands into the canvas, so only it ever touches the image */
+struct Loader {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	FILE *f;
+	int w, h;
+	/* full bands are head, head + 1... in decoding order */
+	struct ColorRGBA *band[LOAD_BANDS];
+	int head, full;
+	bool failed, running;
+	/* post an event for each band, once glfw is up */
+	bool wake;
+};
+
+/* a save to fd, replied to the client with the id given */
+struct SaveReq {
+	int fd;
+	unsigned long client;
+};
+
+/* writes a snapshot of the image to fd while editing goes on. the
+ * snapshot shares the pixels of the image, see imgShare, & only the main
+ * thread touches the image */
+struct Saver {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct Image snap;
+	double startedAt;
+	/* the save running, then the ones waiting for it & for the image to
+	 * load, oldest first. a client has one at most, see Client.saving */
+	struct SaveReq cur, queue[SERVER_CLIENTS];
+	int head, n;
+	bool running;
+	bool done, ok;
+};
+
+/* every cursor position glfw reported since the last frame, in order. a
+ * frame draws them as one polyline, so fast strokes follow the pointer
+ * instead of cutting straight chords between frames */
+struct CursorQueue {
+	struct Vec2f p[CURSOR_QUEUE];
+	size_t head, n;
+};
+
+struct Status {
+	/* last line written & the time it was written at */
+	char shown[256];
+	double shownAt;
+};
+
 struct pie {
-	bool useStdin, useStdout, quit, m0Down, m1Down;
+	bool useStdin, useStdout, quit, m0Down, m1Down, m2Down, redraw;
+	/* run the script at scriptPath, or from the socket, without a window */
+	bool headless;
+	const char *scriptPath;
+	/* socket to listen on. a headless pie only uses one it was given */
+	const char *sockPath;
+	/* shared memory object to export the canvas to, if any */
+	const char *shmName;
 	struct Area area;
 	struct Canvas canvas;
 	struct ColorRGBA color;
 	double brushSize;
+	enum BrushShape brushShape;
+	struct Brush brush;
 	struct Vec2f m, lastM;
+	struct CursorQueue cursor;
 	struct Vec2i win;
-	int sockfd;
+	struct Server server;
+	struct Watcher watcher;
+	struct Status status;
+	/* the running color picker, if any */
+	pid_t picker;
+	struct Loader loader;
+	struct Saver saver;
+	/* when pie started & whether a frame was shown since */
+	double startedAt;
+	bool shown;
 };
 
 static const char *canvasFragSrc = "#version 330 core\n"
 				   "in vec2 texCoord;"
 				   "out vec4 FragColor;"
 				   "uniform sampler2D tex;"
+				   "uniform sampler2D drw;"
+				   "uniform bool uShowDrw;"
 				   "void main() {"
-				   "FragColor = texture(tex, texCoord);"
+				   "float c = 0.05;"
+				   "ivec2 s = textureSize(tex, 0);"
+				   "if (mod(texCoord.x * s.x / 8,2.f) < 1 ^^ "
+				   "mod(texCoord.y * s.y / 8,2.f) < 1) {"
+				   "c = 0.1f;"
+				   "}"
+				   "vec4 i = texture(tex, texCoord);"
+				   "vec3 o = mix(vec3(c,c,c), i.rgb, i.a);"
+				   "if (uShowDrw) {"
+				   "vec4 d = texture(drw, texCoord);"
+				   "o = mix(o, d.rgb, d.a);"
+				   "}"
+				   "FragColor = vec4(o, 1);"
 				   "}";
 
-static const char *bgFragSrc = "#version 330 core\n"
-			       "in vec2 texCoord;"
-			       "out vec4 FragColor;"
-			       "uniform sampler2D tex;"
-			       "void main() {"
-			       "float c = 0.05;"
-			       "ivec2 s = textureSize(tex, 0);"
-			       "if (mod(texCoord.x * s.x / 8,2.f) < 1 ^^ "
-			       "mod(texCoord.y * s.y / 8,2.f) < 1) {"
-			       "c = 0.1f;"
-			       "}"
-			       "FragColor = vec4(c,c,c,1);"
-			       "}";
+/* a quad uQuad pixels big at aOff on the canvas, drawn to the tile at uOrg */
+static const char *stampVertSrc = "#version 330 core\n"
+				  "layout (location = 0) in vec2 aPos;"
+				  "layout (location = 1) in vec2 aOff;"
+				  "out vec2 local;"
+				  "out vec2 pos;"
+				  "uniform vec2 uOrg;"
+				  "uniform vec2 uTile;"
+				  "uniform vec2 uQuad;"
+				  "void main() {"
+				  "local = aPos * uQuad;"
+				  "pos = aOff + local;"
+				  "vec2 p = (pos - uOrg) / uTile * 2 - 1;"
+				  "gl_Position = vec4(p, 0, 1);"
+				  "}";
+
+/* uShape is 0 for square stamps & 1 for round ones, which cover the pixels
+ * whose centers are inside the circle like brushSet. 2 is the anti-aliased
+ * capsule around the segment uSeg, with coverage like strokeCapsuleAA */
+static const char *stampFragSrc = "#version 330 core\n"
+				  "in vec2 local;"
+				  "in vec2 pos;"
+				  "out vec4 FragColor;"
+				  "uniform float uSize;"
+				  "uniform vec4 uColor;"
+				  "uniform int uShape;"
+				  "uniform vec4 uSeg;"
+				  "void main() {"
+				  "vec4 c = uColor;"
+				  "if (uShape == 2) {"
+				  "vec2 a = uSeg.xy, ab = uSeg.zw - a;"
+				  "float l = dot(ab, ab);"
+				  "float t = l > 0 ? "
+				  "clamp(dot(pos - a, ab) / l, 0, 1) : 0;"
+				  "float d = length(pos - a - ab * t);"
+				  "c.a *= clamp(uSize / 2 + 0.5 - d, 0, 1);"
+				  "} else if (uShape == 1 && "
+				  "length(local - uSize / 2) > uSize / 2)"
+				  "discard;"
+				  "if (c.a == 0)"
+				  "discard;"
+				  "FragColor = c;"
+				  "}";
+
+/* covers the whole viewport */
+static const char *blendVertSrc = "#version 330 core\n"
+				  "layout (location = 0) in vec2 aPos;"
+				  "void main() {"
+				  "gl_Position = vec4(aPos * 2 - 1, 0, 1);"
+				  "}";
+
+/* drw over tex from uSrc on, the same as mtBlend */
+static const char *blendFragSrc = "#version 330 core\n"
+				  "out vec4 FragColor;"
+				  "uniform sampler2D tex;"
+				  "uniform sampler2D drw;"
+				  "uniform ivec2 uSrc;"
+				  "void main() {"
+				  "ivec2 p = ivec2(gl_FragCoord.xy) + uSrc;"
+				  "vec4 a = texelFetch(drw, p, 0);"
+				  "vec4 b = texelFetch(tex, p, 0);"
+				  "float bw = b.a * (1 - a.a);"
+				  "float alpha = a.a + bw;"
+				  "FragColor = a.a == 0 ? b : vec4("
+				  "(a.rgb * a.a + b.rgb * bw) / alpha, alpha);"
+				  "}";
 
 #define UI_CANVAS_W 1
 #define UI_CANVAS_H 1
-
+/* longest time in seconds the loop sleeps without events */
+#define UI_IDLE_TIMEOUT 0.5
+/* swap interval used while a mouse button is held */
+#define UI_DRAW_SWAP_INTERVAL 1
+/* most status line updates per second. when stderr is not a terminal every
+ * update is a line of its own, so there are fewer */
+#define UI_STATUS_RATE 30
+#define UI_STATUS_LOG_RATE 1
+/* brush shape at startup, BRUSH_SQUARE or BRUSH_ROUND */
+#define UI_BRUSH_SHAPE BRUSH_SQUARE
+/* anti-alias the edges of round pencil strokes */
+#define UI_BRUSH_AA false
+/* longest time in seconds a frame spends running socket messages */
+#define UI_SOCK_BUDGET 0.004
+/* zoom factor per scroll step below 1x. above it zoom steps by whole
+ * multiples so canvas pixels stay square */
+#define UI_ZOOM_STEP 1.25
+#define UI_ZOOM_MAX 64
+/* most memory in bytes the undo history keeps */
+#define HISTORY_BUDGET ((size_t)256 << 20)
+
+/* socket of a pie with a window, unless given another with -sock */
 static const char socketPath[] = "/tmp/pie.sock";
-static const char *colorPickCmd[] = {"pie-cp", socketPath, NULL};
+/* the picker stays running & sets the color through the socket. SIGUSR1
+ * shows it again */
+static const char colorPicker[] = "pcp";
 
 #define KEY_COLOR_PALETTE GLFW_KEY_Q
 #define KEY_BRUSH_INC_SIZE GLFW_KEY_P
 #define KEY_BRUSH_DEC_SIZE GLFW_KEY_O
+#define KEY_BRUSH_SHAPE GLFW_KEY_B
 #define KEY_QUIT_NOSAVE GLFW_KEY_ESCAPE
 #define KEY_SAMPLE GLFW_KEY_S
 #define KEY_AREA_SELECT GLFW_KEY_A
 #define KEY_AREA_FILL GLFW_KEY_F
 #define KEY_AREA_RESET GLFW_KEY_D
+#define KEY_UNDO GLFW_KEY_U
+#define KEY_REDO GLFW_KEY_R
+#define KEY_VIEW_FIT GLFW_KEY_Z
+
+/* set when stderr is a terminal, which then shows the status line */
+static bool statusTty;
+
+/* messages go on a line of their own, the status line they would be written
+ * after is cleared first */
+static void
+statusPrint(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	if (statusTty)
+		fputs("\r\033[K", stderr);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
 
-#define MAX(a, b) ((a) > (b) ? (a) : (b))
-#define MIN(a, b) ((a) < (b) ? (a) : (b))
+static inline void
+statusPerror(const char *s)
+{
+	if (statusTty)
+		fputs("\r\033[K", stderr);
+	perror(s);
+}
 
 inline double
 mtScaleFitIn(double w0, double h0, double w1, double h1)
@@ -97,21 +415,12 @@ mtScaleFitIn(double w0, double h0, double w1, double h1)
 	return r0 < r1 ? r0 : r1;
 }
 
-static inline struct ColorRGBA
-mtBlend(struct ColorRGBA a, struct ColorRGBA b)
+static inline double
+mtNow(void)
 {
-	double aa = (double)a.a / 255.0;
-	double ba = (double)b.a / 255.0;
-	double k = ba * (1 - aa);
-	double alpha = aa + k;
-
-	struct ColorRGBA out;
-	out.r = (uint8_t)((a.r * aa + b.r * ba * k) / alpha);
-	out.g = (uint8_t)((a.g * aa + b.g * ba * k) / alpha);
-	out.b = (uint8_t)((a.b * aa + b.b * ba * k) / alpha);
-	out.a = (uint8_t)alpha * 0xff;
-
-	return out;
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double)t.tv_sec + t.tv_nsec / 1e9;
 }
 
 static inline struct Vec2f
@@ -128,7 +437,7 @@ mtCanvas2Screen(struct Vec2f mp, struct Canvas *c) {
 }
 
 static void
-grImageGenTexture(struct Image img, unsigned int *out)
+grImageGenTexture(int w, int h, unsigned int *out)
 {
 	glGenTextures(1, out);
 	glBindTexture(GL_TEXTURE_2D, *out);
@@ -141,26 +450,281 @@ grImageGenTexture(struct Image img, unsigned int *out)
 	glTexImage2D(GL_TEXTURE_2D,
 		     0,
 		     GL_RGBA,
-		     img.w,
-		     img.h,
+		     w,
+		     h,
 		     0,
 		     GL_RGBA,
 		     GL_UNSIGNED_BYTE,
-		     img.data);
+		     NULL);
 }
 
-static inline void
-grImageUpdate(struct Image img)
+static inline struct Recti
+grTileRect(struct Image img, int tx, int ty)
+{
+	int x = tx * GR_TILE, y = ty * GR_TILE;
+	int w = MIN(GR_TILE, img.w - x), h = MIN(GR_TILE, img.h - y);
+	return (struct Recti){{x, y}, {w, h}};
+}
+
+static bool
+grTilesGen(struct GrTiles *t, struct Image img)
+{
+	t->tw = (img.w + GR_TILE - 1) / GR_TILE;
+	t->th = (img.h + GR_TILE - 1) / GR_TILE;
+	t->tex = calloc((size_t)t->tw * (size_t)t->th, sizeof *t->tex);
+	if (t->tex == NULL)
+		return false;
+
+	for (int ty = 0; ty < t->th; ty++)
+		for (int tx = 0; tx < t->tw; tx++)
+		{
+			struct Recti r = grTileRect(img, tx, ty);
+			grImageGenTexture(r.size.x,
+					  r.size.y,
+					  &t->tex[ty * t->tw + tx]);
+		}
+	return true;
+}
+
+static void
+grTilesFree(struct GrTiles *t)
 {
+	glDeleteTextures(t->tw * t->th, t->tex);
+	free(t->tex);
+}
+
+static void
+grUploaderInit(struct Uploader *u)
+{
+	/* pixel buffers, glMapBufferRange & sync objects */
+	u->enabled = GLEW_VERSION_3_2;
+	if (u->enabled)
+		glGenBuffers(PBO_COUNT, u->pbo);
+}
+
+static void
+grUploaderFree(struct Uploader *u)
+{
+	if (!u->enabled)
+		return;
+	for (int i = 0; i < PBO_COUNT; i++)
+		if (u->fence[i] != NULL)
+			glDeleteSync(u->fence[i]);
+	glDeleteBuffers(PBO_COUNT, u->pbo);
+}
+
+/* copies the r region of img into the next free pixel buffer and starts the
+ * transfer to the bound texture, which holds img from org on. returns false
+ * if it could not be mapped */
+static bool
+grUploaderUpdate(struct Uploader *u,
+		 struct Image img,
+		 struct Recti r,
+		 struct Vec2i org)
+{
+	int i = u->next;
+	u->next = (i + 1) % PBO_COUNT;
+
+	if (u->fence[i] != NULL)
+	{
+		GLenum res;
+		do
+			res = glClientWaitSync(u->fence[i],
+					       GL_SYNC_FLUSH_COMMANDS_BIT,
+					       1000000000);
+		while (res == GL_TIMEOUT_EXPIRED);
+		glDeleteSync(u->fence[i]);
+		u->fence[i] = NULL;
+	}
+
+	size_t size = (size_t)r.size.x * (size_t)r.size.y * 4;
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, u->pbo[i]);
+	if (u->size[i] < size)
+	{
+		glBufferData(GL_PIXEL_UNPACK_BUFFER,
+			     size,
+			     NULL,
+			     GL_STREAM_DRAW);
+		u->size[i] = size;
+	}
+
+	/* the fence guarantees the gpu is done with this buffer */
+	GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT |
+			    GL_MAP_UNSYNCHRONIZED_BIT;
+	struct ColorRGBA *p = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER,
+					       0,
+					       size,
+					       access);
+	if (p == NULL)
+	{
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return false;
+	}
+
+	imgRead(img, r, p, (size_t)r.size.x);
+
+	if (!glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER))
+	{
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return false;
+	}
+
 	glTexSubImage2D(GL_TEXTURE_2D,
 			0,
+			r.pos.x - org.x,
+			r.pos.y - org.y,
+			r.size.x,
+			r.size.y,
+			GL_RGBA,
+			GL_UNSIGNED_BYTE,
+			0);
+	u->fence[i] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	return true;
+}
+
+/* uploads from client memory, when pixel buffers are not available */
+static void
+grImageUpload(struct Image img, struct Recti r, struct Vec2i org)
+{
+	struct ColorRGBA *buf =
+		malloc((size_t)r.size.x * (size_t)r.size.y * sizeof *buf);
+	if (buf == NULL)
+	{
+		statusPerror("malloc failed");
+		return;
+	}
+
+	imgRead(img, r, buf, (size_t)r.size.x);
+	glTexSubImage2D(GL_TEXTURE_2D,
 			0,
-			0,
-			img.w,
-			img.h,
+			r.pos.x - org.x,
+			r.pos.y - org.y,
+			r.size.x,
+			r.size.y,
 			GL_RGBA,
 			GL_UNSIGNED_BYTE,
-			img.data);
+			buf);
+	free(buf);
+}
+
+/* uploads the r region of img to the bound texture, which holds img from
+ * org on. r lies in one texture, so it is read into a single pixel buffer &
+ * sent with one call */
+static inline void
+grImageUpdate(struct Uploader *u,
+	      struct Image img,
+	      struct Recti r,
+	      struct Vec2i org)
+{
+	if (!u->enabled || !grUploaderUpdate(u, img, r, org))
+		grImageUpload(img, r, org);
+}
+
+/* uploads the r region of img to the textures it falls into only */
+static void
+grTilesUpdate(struct Uploader *u,
+	      struct GrTiles *t,
+	      struct Image img,
+	      struct Recti r)
+{
+	if (rectEmpty(r))
+		return;
+	GR_TILES_IN(r, tx0, ty0, tx1, ty1);
+	for (int ty = ty0; ty <= ty1; ty++)
+		for (int tx = tx0; tx <= tx1; tx++)
+		{
+			struct Recti tr = grTileRect(img, tx, ty);
+			glBindTexture(GL_TEXTURE_2D, t->tex[ty * t->tw + tx]);
+			grImageUpdate(u, img, rectIntersect(r, tr), tr.pos);
+		}
+}
+
+/* maps the shared memory object name & mirrors the image into it */
+static bool
+shmStart(struct Canvas *c, const char *name)
+{
+	size_t len = shmSize(c->img.w, c->img.h);
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+	{
+		perror(name);
+		return false;
+	}
+
+	void *p = MAP_FAILED;
+	if (ftruncate(fd, (off_t)len) == 0)
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+	{
+		perror("failed to map shared memory");
+		shm_unlink(name);
+		return false;
+	}
+
+	c->shm = p;
+	c->shm->w = c->img.w;
+	c->shm->h = c->img.h;
+	struct Recti all = {{0, 0}, {c->img.w, c->img.h}};
+	imgRead(c->img, all, c->shm->px, (size_t)c->img.w);
+	__sync_synchronize();
+	c->shm->magic = SHM_MAGIC;
+	return true;
+}
+
+static inline void
+shmStop(struct Canvas *c, const char *name)
+{
+	if (c->shm == NULL)
+		return;
+	munmap(c->shm, shmSize(c->shm->w, c->shm->h));
+	shm_unlink(name);
+}
+
+/* copies the r region of the image to the export */
+static inline void
+shmMirror(struct Canvas *c, struct Recti r)
+{
+	struct ShmCanvas *s = c->shm;
+	shmWriteBegin(s);
+	imgRead(c->img,
+		r,
+		s->px + (size_t)r.pos.y * (size_t)s->w + (size_t)r.pos.x,
+		(size_t)s->w);
+	shmWriteEnd(s);
+}
+
+/* uploads the visible part of dirty to tex. the rest is kept in stale &
+ * goes up once the view moves over it */
+static inline void
+canvasUpload(struct Canvas *c,
+	     struct GrTiles *t,
+	     struct Image img,
+	     struct Recti *stale,
+	     struct Recti dirty,
+	     bool moved)
+{
+	struct Recti up = rectIntersect(dirty, c->vis);
+	if (moved)
+		up = rectUnion(up, rectIntersect(*stale, c->vis));
+	/* when up leaves a hole in stale, stale keeps the uploaded part too,
+	 * which only costs uploading it again if the view moves */
+	*stale = rectSubtract(rectUnion(*stale, dirty), up);
+	grTilesUpdate(&c->up, t, img, up);
+}
+
+static inline void
+canvasFlush(struct Canvas *c)
+{
+	if (c->shm != NULL && !rectEmpty(c->imgDirty))
+		shmMirror(c, c->imgDirty);
+	bool moved = !rectEqual(c->vis, c->upVis);
+	canvasUpload(c, &c->imgTex, c->img, &c->imgStale, c->imgDirty, moved);
+	canvasUpload(c, &c->drwTex, c->drw, &c->drwStale, c->drwDirty, moved);
+	c->imgDirty = (struct Recti){{0, 0}, {0, 0}};
+	c->drwDirty = (struct Recti){{0, 0}, {0, 0}};
+	c->upVis = c->vis;
 }
 
 static inline void
@@ -183,24 +747,395 @@ grDrawArea(struct Area *s, struct Canvas *c, struct Vec2i win)
 	glEnd();
 }
 
+static inline double
+canvasFitScale(struct Canvas *canvas, struct Vec2i win)
+{
+	return mtScaleFitIn(canvas->img.w,
+			    canvas->img.h,
+			    UI_CANVAS_W * win.x,
+			    UI_CANVAS_H * win.y);
+}
+
 static inline void
 canvasAlign(struct Canvas *canvas, struct Vec2i win)
 {
-	double s = mtScaleFitIn(canvas->img.w,
-				canvas->img.h,
-				UI_CANVAS_W * win.x,
-				UI_CANVAS_H * win.y);
+	double s = canvasFitScale(canvas, win);
 	canvas->scale = s;
 	canvas->r.size.x = canvas->img.w * s;
 	canvas->r.size.y = canvas->img.h * s;
 	canvas->r.pos.x = (UI_CANVAS_W * win.x - canvas->img.w * s) / 2.;
 	canvas->r.pos.y = (UI_CANVAS_H * win.y - canvas->img.h * s) / 2.;
+	canvas->fit = true;
+}
+
+/* canvas pixels at least partly inside the window */
+static inline struct Recti
+canvasVisible(struct Canvas *c, struct Vec2i win)
+{
+	struct Vec2f t = mtScreen2Canvas((struct Vec2f){0, 0}, c);
+	struct Vec2f b = mtScreen2Canvas((struct Vec2f){win.x, win.y}, c);
+	int x0 = (int)floor(CLAMP(t.x, 0, c->img.w));
+	int y0 = (int)floor(CLAMP(t.y, 0, c->img.h));
+	int x1 = (int)ceil(CLAMP(b.x, 0, c->img.w));
+	int y1 = (int)ceil(CLAMP(b.y, 0, c->img.h));
+	if (x1 <= x0 || y1 <= y0)
+		return (struct Recti){{0, 0}, {0, 0}};
+	return (struct Recti){{x0, y0}, {x1 - x0, y1 - y0}};
+}
+
+/* finds the visible part of the canvas, so neither drawing nor uploads
+ * touch the rest */
+static void
+canvasView(struct Canvas *c, struct Vec2i win)
+{
+	/* whole screen pixels per canvas pixel keep every pixel the same
+	 * size, as long as the edges land on whole pixels too */
+	if (c->scale >= 1 && c->scale == floor(c->scale))
+	{
+		c->r.pos.x = round(c->r.pos.x);
+		c->r.pos.y = round(c->r.pos.y);
+	}
+	c->r.size.x = c->img.w * c->scale;
+	c->r.size.y = c->img.h * c->scale;
+	c->vis = canvasVisible(c, win);
+}
+
+/* draws the tiles in view, with the stroke being drawn if showDrw */
+static void
+canvasDraw(struct Canvas *c, struct Vec2i win, bool showDrw)
+{
+	if (rectEmpty(c->vis))
+		return;
+	struct ImgShader *sh = &c->sh;
+	glUseProgram(sh->id);
+	glUniform1i(c->uShowDrw, showDrw);
+	GR_TILES_IN(c->vis, tx0, ty0, tx1, ty1);
+	for (int ty = ty0; ty <= ty1; ty++)
+		for (int tx = tx0; tx <= tx1; tx++)
+		{
+			struct Recti tr = grTileRect(c->img, tx, ty);
+			struct Recti v = rectIntersect(c->vis, tr);
+			struct Vec2f p = {v.pos.x, v.pos.y};
+			double s = c->scale;
+			struct Rect quad = {mtCanvas2Screen(p, c),
+					    {v.size.x * s, v.size.y * s}};
+			struct Rect uv = {
+				{(double)(v.pos.x - tr.pos.x) / tr.size.x,
+				 (double)(v.pos.y - tr.pos.y) / tr.size.y},
+				{(double)v.size.x / tr.size.x,
+				 (double)v.size.y / tr.size.y}};
+			grImgUpdate(sh, quad, win.x, win.y);
+			grImgUpdateUV(sh, uv);
+			int i = ty * c->imgTex.tw + tx;
+			glActiveTexture(GL_TEXTURE1);
+			glBindTexture(GL_TEXTURE_2D, c->drwTex.tex[i]);
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_2D, c->imgTex.tex[i]);
+			glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+		}
+}
+
+/* scales the view by f around the screen point at */
+static void
+canvasZoom(struct Canvas *c, struct Vec2i win, struct Vec2f at, double f)
+{
+	double s = c->scale * f;
+	/* from 1x up, steps are whole multiples */
+	if (s >= 1)
+		s = f > 1 ? floor(c->scale) + 1 : ceil(c->scale) - 1;
+	if (s < 1 && c->scale > 1)
+		s = 1;
+	double min = MIN(canvasFitScale(c, win) / 4, 1);
+	s = CLAMP(s, min, UI_ZOOM_MAX);
+	if (s == c->scale)
+		return;
+
+	struct Vec2f p = mtScreen2Canvas(at, c);
+	c->scale = s;
+	c->r.pos.x = at.x - p.x * s;
+	c->r.pos.y = at.y - p.y * s;
+	c->fit = false;
+	canvasView(c, win);
+}
+
+/* attaches tex to the paint framebuffer & draws to its w x h corner */
+static inline void
+grPaintTarget(struct GrPaint *p, unsigned int tex, int w, int h)
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, p->fbo);
+	glFramebufferTexture2D(
+		GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tex, 0);
+	glViewport(0, 0, w, h);
+}
+
+/* back to drawing to the window */
+static inline void
+grPaintEnd(const int *viewport)
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+}
+
+/* sets up painting on the gpu. the canvas vao must be bound */
+static void
+grPaintInit(struct GrPaint *p)
+{
+	p->stamp = grGenShader(stampVertSrc, stampFragSrc);
+	p->uOrg = glGetUniformLocation(p->stamp, "uOrg");
+	p->uTile = glGetUniformLocation(p->stamp, "uTile");
+	p->uQuad = glGetUniformLocation(p->stamp, "uQuad");
+	p->uSize = glGetUniformLocation(p->stamp, "uSize");
+	p->uColor = glGetUniformLocation(p->stamp, "uColor");
+	p->uShape = glGetUniformLocation(p->stamp, "uShape");
+	p->uSeg = glGetUniformLocation(p->stamp, "uSeg");
+	p->blend = grGenShader(blendVertSrc, blendFragSrc);
+	p->uSrc = glGetUniformLocation(p->blend, "uSrc");
+	glUseProgram(p->blend);
+	glUniform1i(glGetUniformLocation(p->blend, "drw"), 1);
+
+	grImageGenTexture(GR_TILE, GR_TILE, &p->scratch);
+	glGenFramebuffers(1, &p->fbo);
+
+	/* stamp positions, one per instance. the canvas quad ignores them */
+	static const float none[2];
+	glGenBuffers(1, &p->inst);
+	glBindBuffer(GL_ARRAY_BUFFER, p->inst);
+	glBufferData(GL_ARRAY_BUFFER, sizeof none, none, GL_STREAM_DRAW);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), 0);
+	glVertexAttribDivisor(1, 1);
+	glEnableVertexAttribArray(1);
+}
+
+static void
+grPaintFree(struct GrPaint *p)
+{
+	glDeleteProgram(p->stamp);
+	glDeleteProgram(p->blend);
+	glDeleteTextures(1, &p->scratch);
+	glDeleteFramebuffers(1, &p->fbo);
+	glDeleteBuffers(1, &p->inst);
+	free(p->pts);
+}
+
+/* reads the textures back into img where they are ahead of it, if that is
+ * anywhere in the tiles of r. history saves whole tiles, so those have to
+ * be current too */
+static void
+canvasSync(struct Canvas *c, struct Recti r)
+{
+	int x1 = (r.pos.x + r.size.x + TILE_SIZE - 1) & ~(TILE_SIZE - 1);
+	int y1 = (r.pos.y + r.size.y + TILE_SIZE - 1) & ~(TILE_SIZE - 1);
+	r.pos.x &= ~(TILE_SIZE - 1);
+	r.pos.y &= ~(TILE_SIZE - 1);
+	r.size = (struct Vec2i){x1 - r.pos.x, y1 - r.pos.y};
+	if (rectEmpty(rectIntersect(c->ahead, r)))
+		return;
+
+	struct ColorRGBA *buf = malloc((size_t)GR_TILE * GR_TILE * sizeof *buf);
+	if (buf == NULL)
+	{
+		statusPerror("malloc failed");
+		return;
+	}
+
+	int viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	GR_TILES_IN(c->ahead, tx0, ty0, tx1, ty1);
+	for (int ty = ty0; ty <= ty1; ty++)
+		for (int tx = tx0; tx <= tx1; tx++)
+		{
+			struct Recti tr = grTileRect(c->img, tx, ty);
+			struct Recti part = rectIntersect(c->ahead, tr);
+			grPaintTarget(&c->paint,
+				      c->imgTex.tex[ty * c->imgTex.tw + tx],
+				      tr.size.x,
+				      tr.size.y);
+			glReadPixels(part.pos.x - tr.pos.x,
+				     part.pos.y - tr.pos.y,
+				     part.size.x,
+				     part.size.y,
+				     GL_RGBA,
+				     GL_UNSIGNED_BYTE,
+				     buf);
+			imgWrite(c->img, part, buf, (size_t)part.size.x);
+		}
+	grPaintEnd(viewport);
+	free(buf);
+
+	if (c->shm != NULL)
+		shmMirror(c, c->ahead);
+	c->ahead = (struct Recti){{0, 0}, {0, 0}};
+}
+
+/* draws a stroke of b from v0 to v1 into the stroke textures, the same
+ * pixels strokeBrush would write. returns the region that may have been
+ * written to */
+static struct Recti
+canvasStamp(struct Canvas *c,
+	    const struct Brush *b,
+	    struct ColorRGBA color,
+	    struct Vec2i v0,
+	    struct Vec2i v1)
+{
+	struct Recti r = strokeRect(c->img, b, v0, v1);
+	if (rectEmpty(r))
+		return r;
+
+	/* the uploads of the initially empty drw must not land on stamps */
+	struct Recti cpu = rectUnion(c->drwStale, c->drwDirty);
+	grTilesUpdate(&c->up, &c->drwTex, c->drw, cpu);
+	c->drwStale = (struct Recti){{0, 0}, {0, 0}};
+	c->drwDirty = (struct Recti){{0, 0}, {0, 0}};
+
+	struct GrPaint *p = &c->paint;
+	bool aa = UI_BRUSH_AA && b->shape == BRUSH_ROUND;
+	struct Vec2i d = {v1.x - v0.x, v1.y - v0.y};
+	/* a capsule is one quad over all of r, not a row of stamps */
+	int count = aa ? 0 : MAX(abs(d.x), abs(d.y));
+	size_t n = (size_t)count + 1;
+	if (n * 2 > p->cap)
+	{
+		float *pts = realloc(p->pts, n * 2 * sizeof *pts);
+		if (pts == NULL)
+		{
+			perror("realloc failed");
+			exit(EXIT_FAILURE);
+		}
+		p->pts = pts;
+		p->cap = n * 2;
+	}
+	for (int i = 0; i <= count; i++)
+	{
+		struct Vec2i q = strokeStep(v0, d, i, count);
+		p->pts[i * 2] = (float)(q.x + b->top);
+		p->pts[i * 2 + 1] = (float)(q.y + b->top);
+	}
+	if (aa)
+	{
+		p->pts[0] = (float)r.pos.x;
+		p->pts[1] = (float)r.pos.y;
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, p->inst);
+	glBufferData(GL_ARRAY_BUFFER,
+		     (GLsizeiptr)(n * 2 * sizeof *p->pts),
+		     p->pts,
+		     GL_STREAM_DRAW);
+
+	glUseProgram(p->stamp);
+	glUniform1f(p->uSize, (float)b->n);
+	glUniform4f(p->uColor,
+		    color.r / 255.f,
+		    color.g / 255.f,
+		    color.b / 255.f,
+		    color.a / 255.f);
+	glUniform1i(p->uShape, aa ? 2 : b->shape == BRUSH_ROUND);
+	if (aa)
+		glUniform2f(p->uQuad, r.size.x, r.size.y);
+	else
+		glUniform2f(p->uQuad, b->n, b->n);
+	/* centers of the capsule ends, as in strokeCapsuleAA */
+	float o = b->n / 2.f + b->top;
+	glUniform4f(p->uSeg, v0.x + o, v0.y + o, v1.x + o, v1.y + o);
+	/* quads of one stroke share the color, so where they overlap the most
+	 * coverage stays like in strokeCapsuleAA. stamps replace the pixels
+	 * they cover like on the cpu, whatever color was there */
+	if (aa)
+		glBlendEquation(GL_MAX);
+	else
+		glBlendFunc(GL_ONE, GL_ZERO);
+
+	int viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	GR_TILES_IN(r, tx0, ty0, tx1, ty1);
+	for (int ty = ty0; ty <= ty1; ty++)
+		for (int tx = tx0; tx <= tx1; tx++)
+		{
+			struct Recti tr = grTileRect(c->img, tx, ty);
+			grPaintTarget(p,
+				      c->drwTex.tex[ty * c->drwTex.tw + tx],
+				      tr.size.x,
+				      tr.size.y);
+			glUniform2f(p->uOrg, tr.pos.x, tr.pos.y);
+			glUniform2f(p->uTile, tr.size.x, tr.size.y);
+			glDrawElementsInstanced(
+				GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0, (int)n);
+		}
+	grPaintEnd(viewport);
+	glBlendEquation(GL_FUNC_ADD);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	return r;
+}
+
+/* blends the stroke textures into the image textures & clears them. img
+ * falls behind in the stroke until canvasSync */
+static void
+canvasBlend(struct Canvas *c)
+{
+	struct Recti r = c->stroke;
+	if (rectEmpty(r))
+		return;
+
+	/* pixels only img has yet go up first */
+	struct Recti cpu =
+		rectIntersect(rectUnion(c->imgStale, c->imgDirty), r);
+	grTilesUpdate(&c->up, &c->imgTex, c->img, cpu);
+
+	struct GrPaint *p = &c->paint;
+	int viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	glDisable(GL_BLEND);
+	glUseProgram(p->blend);
+	GR_TILES_IN(r, tx0, ty0, tx1, ty1);
+	for (int ty = ty0; ty <= ty1; ty++)
+		for (int tx = tx0; tx <= tx1; tx++)
+		{
+			struct Recti tr = grTileRect(c->img, tx, ty);
+			struct Recti part = rectIntersect(r, tr);
+			struct Vec2i at = {part.pos.x - tr.pos.x,
+					   part.pos.y - tr.pos.y};
+			int i = ty * c->imgTex.tw + tx;
+
+			/* a texture can't be drawn to while it is read */
+			grPaintTarget(p, p->scratch, part.size.x, part.size.y);
+			glUniform2i(p->uSrc, at.x, at.y);
+			glActiveTexture(GL_TEXTURE1);
+			glBindTexture(GL_TEXTURE_2D, c->drwTex.tex[i]);
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_2D, c->imgTex.tex[i]);
+			glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+			glCopyTexSubImage2D(GL_TEXTURE_2D,
+					    0,
+					    at.x,
+					    at.y,
+					    0,
+					    0,
+					    part.size.x,
+					    part.size.y);
+
+			/* the stroke is all drw holds */
+			grPaintTarget(p,
+				      c->drwTex.tex[i],
+				      tr.size.x,
+				      tr.size.y);
+			glClear(GL_COLOR_BUFFER_BIT);
+		}
+	glEnable(GL_BLEND);
+	grPaintEnd(viewport);
+
+	c->ahead = rectUnion(c->ahead, r);
+	/* uploads still pending there would undo the stroke, unless img has
+	 * it too. the shm mirror needs it in img right away */
+	if (!rectEmpty(cpu) || c->shm != NULL)
+		canvasSync(c, c->ahead);
 }
 
 static void
 printUsage(FILE *f, const char *prog)
 {
-	fprintf(f, "%s [-h] [-i] [-o] [-width w] [-height h]\n", prog);
+	fprintf(f,
+		"%s [-h] [-i] [-o] [-width w] [-height h] "
+		"[-shm name] [-gpu] [-sock path] [-headless [-s script]]\n",
+		prog);
 }
 
 static inline void
@@ -228,6 +1163,49 @@ parseArguments(struct pie *pie, int argc, char **argv)
 			printUsage(stdout, argv[0]);
 			exit(EXIT_SUCCESS);
 		}
+		if (strcmp(argv[i], "-gpu") == 0)
+		{
+			pie->canvas.gpu = true;
+			continue;
+		}
+		if (strcmp(argv[i], "-headless") == 0)
+		{
+			pie->headless = true;
+			continue;
+		}
+		if (strcmp(argv[i], "-s") == 0)
+		{
+			i++;
+			if (i >= argc)
+			{
+				fprintf(stderr, "Missing script\n");
+				exit(EXIT_FAILURE);
+			}
+			pie->scriptPath = argv[i];
+			continue;
+		}
+		if (strcmp(argv[i], "-sock") == 0)
+		{
+			i++;
+			if (i >= argc)
+			{
+				fprintf(stderr, "Missing socket path\n");
+				exit(EXIT_FAILURE);
+			}
+			pie->sockPath = argv[i];
+			continue;
+		}
+		if (strcmp(argv[i], "-shm") == 0)
+		{
+			i++;
+			if (i >= argc)
+			{
+				fprintf(stderr, "Missing shared memory name\n");
+				exit(EXIT_FAILURE);
+			}
+			pie->shmName = argv[i];
+			continue;
+		}
 		if (strcmp(argv[i], "-width") == 0)
 		{
 			i++;
@@ -260,142 +1238,152 @@ parseArguments(struct pie *pie, int argc, char **argv)
 	}
 }
 
-static void
-ffwrite(FILE *f, struct Image img)
+static bool
+ffwrite(int fd, struct Image img)
 {
-	fputs("farbfeld", f);
-	uint32_t x = htonl((uint32_t)img.w);
-	fwrite(&x, sizeof x, 1, f);
-	x = htonl((uint32_t)img.h);
-	fwrite(&x, sizeof x, 1, f);
-	for (int i = 0; i < img.w * img.h; i++)
+	struct ColorRGBA *band =
+		malloc((size_t)img.w * TILE_SIZE * sizeof *band);
+	if (band == NULL)
+	{
+		perror("malloc failed");
+		return false;
+	}
+
+	bool ok = ffwriteHeader(fd, img.w, img.h);
+	for (int y = 0; ok && y < img.h; y += TILE_SIZE)
 	{
-		uint16_t y = img.data[i].r * 257;
-		fwrite(&y, sizeof y, 1, f);
-		y = img.data[i].g * 257;
-		fwrite(&y, sizeof y, 1, f);
-		y = img.data[i].b * 257;
-		fwrite(&y, sizeof y, 1, f);
-		y = img.data[i].a * 257;
-		fwrite(&y, sizeof y, 1, f);
+		struct Recti r = {{0, y}, {img.w, MIN(TILE_SIZE, img.h - y)}};
+		imgRead(img, r, band, (size_t)img.w);
+		ok = ffwriteBody(fd, band, (size_t)img.w * (size_t)r.size.y);
 	}
+
+	if (!ok)
+		statusPrint("failed to write image\n");
+	free(band);
+	return ok;
 }
 
 static void
-ffread(FILE *f, struct Canvas *canvas)
+newBlankCanvas(struct Canvas *canvas)
 {
-	uint32_t header[4];
-	fread(header, sizeof header, 1, f);
-	if (header[0] != 0x62726166 && header[1] != 0x646c6566)
+	if (!imgAlloc(&canvas->img, canvas->img.w, canvas->img.h) ||
+	    !imgAlloc(&canvas->drw, canvas->img.w, canvas->img.h) ||
+	    !imgAlloc(&canvas->sockDrw, canvas->img.w, canvas->img.h))
 	{
-		fprintf(stderr, "failed to parse farbfeld magic value\n");
+		perror("Failed to create blank image");
 		exit(EXIT_FAILURE);
 	}
+	canvas->loaded = canvas->img.h;
+}
 
-	canvas->img.w = (signed)ntohl(header[2]);
-	canvas->img.h = (signed)ntohl(header[3]);
-	size_t pixels = (size_t)(canvas->img.w * canvas->img.h);
-	canvas->img.data = malloc(pixels * sizeof *canvas->img.data);
-	if (canvas->img.data == NULL)
-	{
-		perror("malloc failed");
+/* decodes one band of tile rows at a time. tiles of a single color are
+ * stored without pixels */
+static void
+ffread(FILE *f, struct Canvas *canvas)
+{
+	if (!ffreadHeader(f, &canvas->img.w, &canvas->img.h))
 		exit(EXIT_FAILURE);
-	}
+	newBlankCanvas(canvas);
 
-	canvas->drw.data = calloc(1, sizeof *canvas->drw.data * pixels);
-	if (canvas->drw.data == NULL)
+	struct Image img = canvas->img;
+	struct ColorRGBA *band =
+		malloc((size_t)img.w * TILE_SIZE * sizeof *band);
+	if (band == NULL)
 	{
-		free(canvas->img.data);
-		perror("calloc failed");
+		perror("malloc failed");
 		exit(EXIT_FAILURE);
 	}
 
-	for (size_t i = 0; i < pixels; i++)
+	for (int y = 0; y < img.h; y += TILE_SIZE)
 	{
-		struct ColorRGBA c;
-		uint16_t x;
-		fread(&x, sizeof x, 1, f);
-		c.r = x / 257;
-		fread(&x, sizeof x, 1, f);
-		c.g = x / 257;
-		fread(&x, sizeof x, 1, f);
-		c.b = x / 257;
-		fread(&x, sizeof x, 1, f);
-		c.a = x / 257;
-		canvas->img.data[i] = c;
+		struct Recti r = {{0, y}, {img.w, MIN(TILE_SIZE, img.h - y)}};
+		if (!ffreadBody(f, band, (size_t)img.w * (size_t)r.size.y))
+			exit(EXIT_FAILURE);
+		imgWrite(img, r, band, (size_t)img.w);
+		struct Tile *row = &img.tiles[(y >> TILE_SHIFT) * img.tw];
+		for (int tx = 0; tx < img.tw; tx++)
+			tileCompact(&row[tx]);
 	}
 
-	canvas->drw.w = canvas->img.w;
-	canvas->drw.h = canvas->img.h;
+	free(band);
 }
 
-static void
-newBlankCanvas(struct Canvas *canvas)
+static void *
+loaderRun(void *data)
 {
-	unsigned int pixels = (unsigned int)(canvas->img.h * canvas->img.w);
-	canvas->img.data = calloc(1, pixels * sizeof *canvas->img.data);
-	if (canvas->img.data == NULL)
+	struct Loader *l = data;
+	for (int y = 0; y < l->h; y += TILE_SIZE)
 	{
-		perror("Failed to create blank image");
-		exit(EXIT_FAILURE);
+		pthread_mutex_lock(&l->mutex);
+		while (l->full == LOAD_BANDS)
+			pthread_cond_wait(&l->cond, &l->mutex);
+		int i = (l->head + l->full) % LOAD_BANDS;
+		pthread_mutex_unlock(&l->mutex);
+
+		size_t rows = (size_t)MIN(TILE_SIZE, l->h - y);
+		bool ok = ffreadBody(l->f, l->band[i], (size_t)l->w * rows);
+
+		pthread_mutex_lock(&l->mutex);
+		if (ok)
+			l->full++;
+		else
+			l->failed = true;
+		pthread_cond_broadcast(&l->cond);
+		if (l->wake)
+			glfwPostEmptyEvent();
+		pthread_mutex_unlock(&l->mutex);
+		if (!ok)
+			break;
 	}
+	return NULL;
+}
 
-	canvas->drw.data = calloc(1, pixels * sizeof *canvas->drw.data);
-	if (canvas->drw.data == NULL)
+static void
+loaderStart(struct Loader *l, FILE *f, int w, int h)
+{
+	l->f = f;
+	l->w = w;
+	l->h = h;
+	for (int i = 0; i < LOAD_BANDS; i++)
 	{
-		free(canvas->img.data);
-		perror("Failed to create blank image");
+		l->band[i] = malloc((size_t)w * TILE_SIZE * sizeof *l->band[i]);
+		if (l->band[i] == NULL)
+		{
+			perror("malloc failed");
+			exit(EXIT_FAILURE);
+		}
+	}
+	pthread_mutex_init(&l->mutex, NULL);
+	pthread_cond_init(&l->cond, NULL);
+	if (pthread_create(&l->thread, NULL, loaderRun, l) != 0)
+	{
+		fprintf(stderr, "failed to start image loader\n");
 		exit(EXIT_FAILURE);
 	}
+	l->running = true;
 }
 
 static void
 loadInputFile(struct pie *pie)
 {
-	if (pie->useStdin)
+	if (!pie->useStdin)
+	{
+		newBlankCanvas(&pie->canvas);
+		return;
+	}
+	if (pie->headless)
 	{
 		ffread(stdin, &pie->canvas);
 		return;
 	}
-	newBlankCanvas(&pie->canvas);
-}
 
-static void
-strokeSizePencil(struct Image read,
-		 struct Image write,
-		 struct ColorRGBA color,
-		 double size,
-		 struct Vec2i v0,
-		 struct Vec2i v1)
-{
-	struct Vec2i d = {v1.x - v0.x, v1.y - v0.y};
-	struct Vec2i absd = {abs(d.x), abs(d.y)};
-	double count = MAX(absd.x, absd.y);
-	struct Vec2f step = {d.x / count, d.y / count};
-	struct Vec2f cur = {v0.x, v0.y};
-
-	for (size_t i = 0; i < (size_t)(count + 1); i++)
-	{
-		double maxSize = size * 2;
-		double sx = size - cur.x;
-		int x = (int)MAX(sx, 0);
-		int w = (int)MIN(sx + read.w, maxSize);
-		double sy = size - cur.y;
-		int y = (int)MAX(sy, 0);
-		int h = (int)MIN(sy + read.w, maxSize);
-
-		for (int j = y; j < h; j++)
-			for (int k = x; k < w; k++)
-			{
-				int px = k + (int)cur.x - (int)size;
-				int py = j + (int)cur.y - (int)size;
-				size_t id = (size_t)(px + py * read.w);
-				write.data[id] = color;
-			}
-
-		cur.x += step.x;
-		cur.y += step.y;
-	}
+	/* the body arrives while the window opens */
+	struct Canvas *c = &pie->canvas;
+	if (!ffreadHeader(stdin, &c->img.w, &c->img.h))
+		exit(EXIT_FAILURE);
+	newBlankCanvas(c);
+	c->loaded = 0;
+	loaderStart(&pie->loader, stdin, c->img.w, c->img.h);
 }
 
 static inline void
@@ -427,65 +1415,213 @@ areaP2(struct Area *s, struct Vec2i p)
 	s->pointSet = false;
 }
 
+/* editing operations shared by the window & headless scripts. positions
+ * are in canvas pixels */
+
+static inline struct Vec2i
+canvasClamp(const struct Canvas *c, long x, long y)
+{
+	return (struct Vec2i){(int)CLAMP(x, 0, c->img.w - 1),
+			      (int)CLAMP(y, 0, c->img.h - 1)};
+}
+
+/* rows still loading can't be edited, their pixels would be overwritten */
+static inline struct Recti
+canvasLoadedRect(const struct Canvas *c)
+{
+	return (struct Recti){{0, 0}, {c->img.w, c->loaded}};
+}
+
+/* starts an undoable edit, unless an eraser stroke in progress is open.
+ * returns whether the caller has to end it */
+static inline bool
+editBegin(struct Canvas *c)
+{
+	if (c->hist.open)
+		return false;
+	histBegin(&c->hist);
+	return true;
+}
+
 static inline void
-commitDraw(struct Image img, struct Image drw)
+editEnd(struct Canvas *c, bool own)
 {
-	for (size_t i = 0; i < (size_t)(drw.w * drw.h); i++)
+	if (own)
+		histEnd(&c->hist);
+}
+
+/* draws a pencil segment into the stroke layer */
+static void
+editPencil(struct pie *pie,
+	   struct ColorRGBA color,
+	   struct Vec2i v0,
+	   struct Vec2i v1)
+{
+	struct Canvas *c = &pie->canvas;
+	brushSet(&pie->brush, pie->brushShape, pie->brushSize / 2);
+	if (c->gpu)
 	{
-		struct ColorRGBA color = mtBlend(drw.data[i], img.data[i]);
-		img.data[i] = color;
-		drw.data[i] = (struct ColorRGBA){0, 0, 0, 0};
+		struct Recti r = canvasStamp(c, &pie->brush, color, v0, v1);
+		c->stroke = rectUnion(c->stroke, r);
+		return;
 	}
+	struct Recti r =
+		strokeBrush(c->drw, &pie->brush, color, UI_BRUSH_AA, v0, v1);
+	c->drwDirty = rectUnion(c->drwDirty, r);
+	c->stroke = rectUnion(c->stroke, r);
 }
 
-static inline void
-imageFill(struct Image i, struct Recti r, struct ColorRGBA c)
+/* blends the stroke layer into the image as one undoable edit */
+static void
+editCommit(struct Canvas *c)
+{
+	/* the stroke waits in drw for its rows to load */
+	if (c->stroke.pos.y + c->stroke.size.y > c->loaded)
+		return;
+	bool own = editBegin(c);
+	canvasSync(c, c->stroke);
+	if (c->gpu)
+	{
+		/* only the gpu knows which tiles the stroke left empty */
+		histSave(&c->hist, c->img, c->stroke, NULL);
+		canvasBlend(c);
+	} else
+	{
+		histSave(&c->hist, c->img, c->stroke, &c->drw);
+		commitDraw(c->img, c->drw, c->stroke);
+		c->imgDirty = rectUnion(c->imgDirty, c->stroke);
+		c->drwDirty = rectUnion(c->drwDirty, c->stroke);
+	}
+	editEnd(c, own);
+	c->stroke = (struct Recti){{0, 0}, {0, 0}};
+}
+
+/* erases a segment of the image. part of the open edit, if any */
+static void
+editErase(struct pie *pie, struct Vec2i v0, struct Vec2i v1)
 {
-	for (int x = r.pos.x; x < r.size.x + r.pos.x; x++)
-		for (int y = r.pos.y; y < r.size.y + r.pos.y; y++)
-			i.data[x + y * i.w] = c;
+	struct Canvas *c = &pie->canvas;
+	brushSet(&pie->brush, pie->brushShape, pie->brushSize / 2);
+	struct Recti r = strokeRect(c->img, &pie->brush, v0, v1);
+	if (r.pos.y + r.size.y > c->loaded)
+		return;
+	canvasSync(c, r);
+	histSave(&c->hist, c->img, r, NULL);
+	strokeBrush(c->img,
+		    &pie->brush,
+		    (struct ColorRGBA){0, 0, 0, 0},
+		    false,
+		    v0,
+		    v1);
+	c->imgDirty = rectUnion(c->imgDirty, r);
 }
 
-static inline void
-mouseDown(struct pie *pie, struct Vec2f start, struct Vec2f end)
+/* draws a pencil segment sent through the socket as an edit of its own. the
+ * stroke the user is drawing stays in drw, untouched. the parts of the
+ * segment on rows still loading are dropped */
+static void
+editStroke(struct pie *pie,
+	   struct ColorRGBA color,
+	   struct Vec2i v0,
+	   struct Vec2i v1)
 {
-	if (pie->area.selecting)
+	struct Canvas *c = &pie->canvas;
+	brushSet(&pie->brush, pie->brushShape, pie->brushSize / 2);
+	struct Recti r = strokeBrush(c->sockDrw,
+				     &pie->brush,
+				     color,
+				     UI_BRUSH_AA,
+				     v0,
+				     v1);
+	struct Recti in = rectIntersect(r, canvasLoadedRect(c));
+	bool own = editBegin(c);
+	canvasSync(c, in);
+	histSave(&c->hist, c->img, in, &c->sockDrw);
+	commitDraw(c->img, c->sockDrw, in);
+	editEnd(c, own);
+	c->imgDirty = rectUnion(c->imgDirty, in);
+
+	/* the layer holds nothing but the segment, so its tiles empty whole */
+	r = rectClip(r, c->sockDrw.w, c->sockDrw.h);
+	if (rectEmpty(r))
 		return;
+	TILES_IN(r, tx0, ty0, tx1, ty1);
+	for (int ty = ty0; ty <= ty1; ty++)
+		for (int tx = tx0; tx <= tx1; tx++)
+			tileSetFill(&c->sockDrw.tiles[tx + ty * c->sockDrw.tw],
+				    (struct ColorRGBA){0, 0, 0, 0});
+}
+
+static void
+editFill(struct Canvas *c, struct Recti area, struct ColorRGBA color)
+{
+	area = rectIntersect(area, canvasLoadedRect(c));
+	bool own = editBegin(c);
+	canvasSync(c, area);
+	histSave(&c->hist, c->img, area, NULL);
+	struct Recti r = imageFill(c->img, area, color);
+	editEnd(c, own);
+	c->imgDirty = rectUnion(c->imgDirty, r);
+}
+
+/* copies pixels into r, which must lie inside the image */
+static void
+editPut(struct Canvas *c,
+	struct Recti r,
+	const struct ColorRGBA *src,
+	size_t stride)
+{
+	bool own = editBegin(c);
+	canvasSync(c, r);
+	histSave(&c->hist, c->img, r, NULL);
+	imgWrite(c->img, r, src, stride);
+	editEnd(c, own);
+	c->imgDirty = rectUnion(c->imgDirty, r);
+}
+
+static void
+editUndo(struct Canvas *c, bool redo)
+{
+	canvasSync(c, (struct Recti){{0, 0}, {c->img.w, c->img.h}});
+	struct Recti r = redo ? histRedo(&c->hist, c->img)
+			      : histUndo(&c->hist, c->img);
+	c->imgDirty = rectUnion(c->imgDirty, r);
+}
+
+/* the segment from start to end in canvas pixels, if it starts on it */
+static inline bool
+mouseSegment(struct pie *pie,
+	     struct Vec2f start,
+	     struct Vec2f end,
+	     struct Vec2i *v0,
+	     struct Vec2i *v1)
+{
 	struct Vec2f rs = mtScreen2Canvas(start, &pie->canvas);
-	if (BOUNDS_ZERO(rs.x, rs.y, pie->canvas.img.w, pie->canvas.img.h))
-	{
-		struct Vec2f re = mtScreen2Canvas(end, &pie->canvas);
-		re.x = CLAMP(re.x, 0, pie->canvas.img.w - 1);
-		re.y = CLAMP(re.y, 0, pie->canvas.img.h - 1);
-		strokeSizePencil(pie->canvas.img,
-				 pie->canvas.drw,
-				 pie->color,
-				 pie->brushSize / 2,
-				 (struct Vec2i){(int)rs.x, (int)rs.y},
-				 (struct Vec2i){(int)re.x, (int)re.y});
-		glBindTexture(GL_TEXTURE_2D, pie->canvas.drwTex);
-		grImageUpdate(pie->canvas.drw);
-	}
+	if (!BOUNDS_ZERO(rs.x, rs.y, pie->canvas.img.w, pie->canvas.img.h))
+		return false;
+
+	struct Vec2f re = mtScreen2Canvas(end, &pie->canvas);
+	re.x = CLAMP(re.x, 0, pie->canvas.img.w - 1);
+	re.y = CLAMP(re.y, 0, pie->canvas.img.h - 1);
+	*v0 = (struct Vec2i){(int)rs.x, (int)rs.y};
+	*v1 = (struct Vec2i){(int)re.x, (int)re.y};
+	return true;
+}
+
+static inline void
+mouseDown(struct pie *pie, struct Vec2f start, struct Vec2f end)
+{
+	struct Vec2i v0, v1;
+	if (!pie->area.selecting && mouseSegment(pie, start, end, &v0, &v1))
+		editPencil(pie, pie->color, v0, v1);
 }
 
 static inline void
 mouse2Down(struct pie *pie, struct Vec2f start, struct Vec2f end)
 {
-	struct Vec2f rs = mtScreen2Canvas(start, &pie->canvas);
-	if (BOUNDS_ZERO(rs.x, rs.y, pie->canvas.img.w, pie->canvas.img.h))
-	{
-		struct Vec2f re = mtScreen2Canvas(end, &pie->canvas);
-		re.x = CLAMP(re.x, 0, pie->canvas.img.w - 1);
-		re.y = CLAMP(re.y, 0, pie->canvas.img.h - 1);
-		strokeSizePencil(pie->canvas.img,
-				 pie->canvas.img,
-				 (struct ColorRGBA){0, 0, 0, 0},
-				 pie->brushSize / 2,
-				 (struct Vec2i){(int)rs.x, (int)rs.y},
-				 (struct Vec2i){(int)re.x, (int)re.y});
-		glBindTexture(GL_TEXTURE_2D, pie->canvas.imgTex);
-		grImageUpdate(pie->canvas.img);
-	}
+	struct Vec2i v0, v1;
+	if (mouseSegment(pie, start, end, &v0, &v1))
+		editErase(pie, v0, v1);
 }
 
 static inline void
@@ -505,9 +1641,7 @@ mouseJustUp(struct pie *pie)
 		return;
 	}
 
-	commitDraw(pie->canvas.img, pie->canvas.drw);
-	glBindTexture(GL_TEXTURE_2D, pie->canvas.imgTex);
-	grImageUpdate(pie->canvas.img);
+	editCommit(&pie->canvas);
 }
 
 static inline void
@@ -522,24 +1656,53 @@ mouseJustDown(struct pie *pie)
 		areaAbort(&pie->area);
 }
 
-static void
+/* starts cmd, which dies with pie. SIGUSR1 stays blocked across exec until
+ * cmd is ready for it, SIGPIPE gets back the default pie ignores */
+static pid_t
 runCmd(const char **cmd)
 {
+	sigset_t usr1, old;
+	sigemptyset(&usr1);
+	sigaddset(&usr1, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &usr1, &old);
 	pid_t pid = fork();
 
 	if (pid < 0)
-	{
-		perror("\r\033[Kfork failed");
-		return;
-	}
+		statusPerror("fork failed");
 
 	if (pid == 0)
 	{
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		signal(SIGPIPE, SIG_DFL);
 		execvp(cmd[0], (void *)cmd);
 
-		perror("\r\033[Kexec failed");
+		statusPerror("exec failed");
 		_exit(EXIT_FAILURE);
 	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return pid;
+}
+
+/* reaps exited children */
+static inline void
+childrenReap(struct pie *pie)
+{
+	pid_t pid;
+	while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+		if (pid == pie->picker)
+			pie->picker = 0;
+}
+
+/* shows the running picker or starts one */
+static inline void
+pickerShow(struct pie *pie)
+{
+	childrenReap(pie);
+	if (pie->picker > 0 && kill(pie->picker, SIGUSR1) == 0)
+		return;
+	const char *cmd[] = {colorPicker, pie->sockPath, NULL};
+	pie->picker = runCmd(cmd);
 }
 
 static inline void
@@ -554,6 +1717,11 @@ setupSock(const char *path, int *outFd)
 
 	struct sockaddr_un addr = {0};
 	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof addr.sun_path)
+	{
+		fprintf(stderr, "socket path %s is too long\n", path);
+		exit(EXIT_FAILURE);
+	}
 	strcpy(addr.sun_path, path);
 
 	unlink(path);
@@ -570,66 +1738,779 @@ setupSock(const char *path, int *outFd)
 	*outFd = fd;
 }
 
-inline void
-runMsg(struct pie *pie, struct Msg m, int fd)
+/* queues a reply. false if c stopped reading them */
+static bool
+clientReply(struct Client *c, const void *data, size_t len)
 {
-	switch (m.id)
+	if (len > sizeof c->out - c->outLen)
 	{
-	case MSG_GET_COLOR:
-		write(fd, &pie->color, sizeof(pie->color));
+		statusPrint("client does not read its replies\n");
+		return false;
+	}
+	memcpy(c->out + c->outLen, data, len);
+	c->outLen += len;
+	return true;
+}
+
+static inline bool
+regionValid(struct MsgRect r)
+{
+	return r.w > 0 && r.h > 0 && r.w <= REGION_MAX && r.h <= REGION_MAX &&
+	       r.x >= -REGION_MAX && r.x <= REGION_MAX &&
+	       r.y >= -REGION_MAX && r.y <= REGION_MAX;
+}
+
+/* maps the memfd holding the pixels of region r. it must be sealed against
+ * shrinking, or the client could cut the mapping short while pie uses it,
+ * which raises SIGBUS */
+static struct ColorRGBA *
+regionMap(int fd, struct MsgRect r, bool writable)
+{
+	size_t len = (size_t)r.w * (size_t)r.h * sizeof(struct ColorRGBA);
+	int seals = fcntl(fd, F_GET_SEALS);
+	if (seals == -1 || !(seals & F_SEAL_SHRINK))
+		return NULL;
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size < 0 || (size_t)st.st_size < len)
+		return NULL;
+
+	int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+	void *p = mmap(NULL, len, prot, MAP_SHARED, fd, 0);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+/* takes the fd sent with the message being run. -1 if there is none */
+static int
+clientNextFd(struct Client *c)
+{
+	if (c->nfds == 0)
+	{
+		statusPrint("message sent without an fd\n");
+		return -1;
+	}
+	int fd = c->fds[0];
+	memmove(c->fds, c->fds + 1, --c->nfds * sizeof *c->fds);
+	return fd;
+}
+
+/* copies a region between the canvas & the memfd sent with the message.
+ * the region is clipped to the canvas */
+static bool
+runRegion(struct pie *pie, struct Client *c, bool get, struct MsgRect mr)
+{
+	int fd = clientNextFd(c);
+	if (fd == -1)
+		return false;
+
+	struct ColorRGBA *px = NULL;
+	if (regionValid(mr))
+		px = regionMap(fd, mr, get);
+	close(fd);
+	if (px == NULL)
+	{
+		statusPrint("invalid region or memfd\n");
+		return false;
+	}
+
+	struct Canvas *cv = &pie->canvas;
+	struct Recti req = {{mr.x, mr.y}, {mr.w, mr.h}};
+	struct Recti r = rectIntersect(req, canvasLoadedRect(cv));
+	if (!rectEmpty(r))
+	{
+		struct ColorRGBA *p = px +
+				      (size_t)(r.pos.y - mr.y) * (size_t)mr.w +
+				      (size_t)(r.pos.x - mr.x);
+		if (get)
+		{
+			canvasSync(cv, r);
+			imgRead(cv->img, r, p, (size_t)mr.w);
+		}
+		else
+			editPut(cv, r, p, (size_t)mr.w);
+	}
+	munmap(px, (size_t)mr.w * (size_t)mr.h * sizeof *px);
+
+	if (!get)
+		return true;
+	struct MsgRect done = {r.pos.x, r.pos.y, r.size.x, r.size.y};
+	return clientReply(c, &done, sizeof done);
+}
+
+/* lets the loader wake the main loop, now that glfw is initialized */
+static inline void
+loaderWake(struct Loader *l)
+{
+	if (!l->running)
 		return;
-	case MSG_SET_COLOR:
-		pie->color = m.data.color;
+	pthread_mutex_lock(&l->mutex);
+	l->wake = true;
+	pthread_mutex_unlock(&l->mutex);
+}
+
+/* copies the bands the loader decoded into the canvas, waiting for one if
+ * wait is set. strokes held back for unloaded rows are committed once all
+ * rows are in, or once a bad body ended loading */
+static void
+loaderPoll(struct pie *pie, bool wait)
+{
+	struct Loader *l = &pie->loader;
+	struct Canvas *c = &pie->canvas;
+	if (!l->running)
 		return;
-	default:
-		fprintf(stderr, "\r\033[KUnknown message id \"%lu\"\n", m.id);
+
+	pthread_mutex_lock(&l->mutex);
+	while (wait && l->full == 0 && !l->failed)
+		pthread_cond_wait(&l->cond, &l->mutex);
+	int n = l->full;
+	bool failed = l->failed;
+	pthread_mutex_unlock(&l->mutex);
+
+	for (int i = 0; i < n; i++)
+	{
+		int y = c->loaded, rows = MIN(TILE_SIZE, c->img.h - y);
+		struct Recti r = {{0, y}, {c->img.w, rows}};
+		imgWrite(c->img,
+			 r,
+			 l->band[(l->head + i) % LOAD_BANDS],
+			 (size_t)c->img.w);
+		struct Tile *row = &c->img.tiles[(y >> TILE_SHIFT) * c->img.tw];
+		for (int tx = 0; tx < c->img.tw; tx++)
+			tileCompact(&row[tx]);
+		c->imgDirty = rectUnion(c->imgDirty, r);
+		c->loaded += r.size.y;
 	}
+
+	pthread_mutex_lock(&l->mutex);
+	l->head = (l->head + n) % LOAD_BANDS;
+	l->full -= n;
+	pthread_cond_broadcast(&l->cond);
+	pthread_mutex_unlock(&l->mutex);
+
+	if (!failed && c->loaded < c->img.h)
+		return;
+
+	pthread_join(l->thread, NULL);
+	for (int i = 0; i < LOAD_BANDS; i++)
+		free(l->band[i]);
+	l->running = false;
+	if (failed)
+	{
+		/* ffreadBody said why. the rest stays transparent, like after
+		 * loaderStop, & can be painted on */
+		statusPrint("loaded %d of %d rows\n", c->loaded, c->img.h);
+		c->loaded = c->img.h;
+	} else
+		statusPrint("loaded %dx%d in %.1f ms\n",
+			    c->img.w,
+			    c->img.h,
+			    (mtNow() - pie->startedAt) * 1e3);
+	if (!rectEmpty(c->stroke) && !pie->m0Down)
+		editCommit(c);
 }
 
+/* stops loading, leaving the rows not loaded yet transparent */
 static inline void
-pollSock(struct pie *pie)
+loaderStop(struct Loader *l)
+{
+	if (!l->running)
+		return;
+	pthread_cancel(l->thread);
+	pthread_join(l->thread, NULL);
+	l->running = false;
+}
+
+static void *
+saverRun(void *data)
 {
-	struct pollfd pfd = {pie->sockfd, POLLIN, 0};
-	int res = poll(&pfd, 1, 0);
-	switch (res)
+	struct Saver *s = data;
+	bool ok = ffwrite(s->cur.fd, s->snap);
+	/* quitting cancels a save that takes too long, see saverStop */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	pthread_mutex_lock(&s->mutex);
+	s->ok = ok;
+	s->done = true;
+	pthread_cond_signal(&s->cond);
+	glfwPostEmptyEvent();
+	pthread_mutex_unlock(&s->mutex);
+	return NULL;
+}
+
+/* replies to the client that asked for the save, if it is still connected */
+static void
+saverReply(struct pie *pie, struct SaveReq r, bool ok)
+{
+	uint64_t reply = ok;
+	for (uint32_t i = 0; i < SERVER_CLIENTS; i++)
 	{
-	case -1:
-		perror("poll failed");
-		exit(EXIT_FAILURE);
-	case 0:
+		struct Client *c = pie->server.clients[i];
+		if (c == NULL || c->id != r.client)
+			continue;
+		c->saving = false;
+		c->bad |= !clientReply(c, &reply, sizeof reply);
+	}
+}
+
+/* snapshots the image & starts writing it for the oldest queued save. only
+ * the tile table is copied here, the pixels are shared until an edit
+ * changes them */
+static void
+saverStart(struct pie *pie)
+{
+	struct Saver *s = &pie->saver;
+	struct Canvas *c = &pie->canvas;
+	s->cur = s->queue[s->head];
+	s->head = (s->head + 1) % SERVER_CLIENTS;
+	s->n--;
+	s->startedAt = mtNow();
+	canvasSync(c, (struct Recti){{0, 0}, {c->img.w, c->img.h}});
+	if (!imgShare(c->img, &s->snap))
+	{
+		statusPerror("malloc failed");
+		close(s->cur.fd);
+		saverReply(pie, s->cur, false);
 		return;
 	}
 
-	if (!(pfd.revents & POLLIN))
+	s->done = false;
+	pthread_condattr_t ca;
+	pthread_condattr_init(&ca);
+	pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+	pthread_mutex_init(&s->mutex, NULL);
+	pthread_cond_init(&s->cond, &ca);
+	pthread_condattr_destroy(&ca);
+	if (pthread_create(&s->thread, NULL, saverRun, s) != 0)
+	{
+		statusPrint("failed to start saving\n");
+		pthread_mutex_destroy(&s->mutex);
+		pthread_cond_destroy(&s->cond);
+		imgUnshare(c->img, &c->hist, &s->snap);
+		close(s->cur.fd);
+		saverReply(pie, s->cur, false);
 		return;
+	}
+	s->running = true;
+}
 
-	int clientfd;
-	if ((clientfd = accept(pie->sockfd, NULL, NULL)) == -1)
+/* joins the running save. one cancelled before it was done failed */
+static void
+saverFinish(struct pie *pie)
+{
+	struct Saver *s = &pie->saver;
+	struct Canvas *c = &pie->canvas;
+	pthread_join(s->thread, NULL);
+	pthread_mutex_destroy(&s->mutex);
+	pthread_cond_destroy(&s->cond);
+	close(s->cur.fd);
+	imgUnshare(c->img, &c->hist, &s->snap);
+	s->running = false;
+	bool ok = s->done && s->ok;
+	if (ok)
+		statusPrint("saved %dx%d in %.1f ms\n",
+			    c->img.w,
+			    c->img.h,
+			    (mtNow() - s->startedAt) * 1e3);
+	saverReply(pie, s->cur, ok);
+}
+
+/* finishes the running save if it is done & starts the next one once the
+ * image is loaded. never waits for either */
+static void
+saverPoll(struct pie *pie)
+{
+	struct Saver *s = &pie->saver;
+	struct Canvas *c = &pie->canvas;
+	if (s->running)
 	{
-		perror("accept failed");
-		exit(EXIT_FAILURE);
+		pthread_mutex_lock(&s->mutex);
+		bool done = s->done;
+		pthread_mutex_unlock(&s->mutex);
+		if (!done)
+			return;
+		saverFinish(pie);
+	}
+	while (!s->running && s->n > 0 && c->loaded == c->img.h)
+		saverStart(pie);
+}
+
+/* lets the saves run until the time until & fails the rest, along with the
+ * ones still waiting for the image. a reader that stalls its save cannot
+ * hold up quitting */
+static void
+saverStop(struct pie *pie, double until)
+{
+	struct Saver *s = &pie->saver;
+	struct timespec t = {(time_t)until,
+			     (long)((until - (double)(time_t)until) * 1e9)};
+	for (saverPoll(pie); s->running; saverPoll(pie))
+	{
+		pthread_mutex_lock(&s->mutex);
+		int err = 0;
+		while (!s->done && err != ETIMEDOUT)
+			err = pthread_cond_timedwait(&s->cond, &s->mutex, &t);
+		bool done = s->done;
+		pthread_mutex_unlock(&s->mutex);
+		if (done)
+			continue;
+		pthread_cancel(s->thread);
+		saverFinish(pie);
+		break;
+	}
+
+	for (; s->n > 0; s->n--)
+	{
+		struct SaveReq r = s->queue[s->head];
+		s->head = (s->head + 1) % SERVER_CLIENTS;
+		close(r.fd);
+		saverReply(pie, r, false);
+	}
+}
+
+/* queues a save to the fd sent with the message. it starts once the image
+ * is loaded & the saves before it are done, & c gets the reply when it is
+ * done, see saverPoll */
+static bool
+runSave(struct pie *pie, struct Client *c)
+{
+	int fd = clientNextFd(c);
+	if (fd == -1)
+		return false;
+
+	struct Saver *s = &pie->saver;
+	if (s->n == SERVER_CLIENTS)
+	{
+		/* saves of clients that hung up fill the queue */
+		statusPrint("too many saves waiting\n");
+		close(fd);
+		uint64_t reply = false;
+		return clientReply(c, &reply, sizeof reply);
 	}
+	s->queue[(s->head + s->n++) % SERVER_CLIENTS] =
+		(struct SaveReq){fd, c->id};
+	c->saving = true;
+	saverPoll(pie);
+	return true;
+}
 
-	struct Msg msg;
-	ssize_t n = read(clientfd, &msg, sizeof(msg));
-	if (n != sizeof(msg))
+/* runs one message of c. false if c sent something it should not have */
+static bool
+runMsg(struct pie *pie,
+       struct Client *c,
+       struct Msg m,
+       const unsigned char *payload)
+{
+	struct Canvas *cv = &pie->canvas;
+	struct MsgRect mr;
+	struct MsgStroke ms;
+	switch (m.id)
+	{
+	case MSG_GET_COLOR:
+		return clientReply(c, &pie->color, sizeof(pie->color));
+	case MSG_SET_COLOR:
+		pie->color = m.data.color;
+		pie->redraw = true;
+		return true;
+	case MSG_GET_REGION:
+	case MSG_PUT_REGION:
+		memcpy(&mr, payload, sizeof mr);
+		return runRegion(pie, c, m.id == MSG_GET_REGION, mr);
+	case MSG_FILL_RECT:
+		memcpy(&mr, payload, sizeof mr);
+		if (regionValid(mr))
+			editFill(cv,
+				 (struct Recti){{mr.x, mr.y}, {mr.w, mr.h}},
+				 m.data.color);
+		return true;
+	case MSG_STROKE:
+		memcpy(&ms, payload, sizeof ms);
+		editStroke(pie,
+			   m.data.color,
+			   canvasClamp(cv, ms.x0, ms.y0),
+			   canvasClamp(cv, ms.x1, ms.y1));
+		return true;
+	case MSG_SAVE:
+		return runSave(pie, c);
+	default:
+		statusPrint("Unknown message id \"%lu\"\n", m.id);
+		return false;
+	}
+}
+
+static void
+serverStart(struct Server *s, const char *path)
+{
+	setupSock(path, &s->fd);
+	s->epfd = epoll_create1(0);
+	struct epoll_event ev = {EPOLLIN, {.u32 = SERVER_CLIENTS}};
+	if (s->epfd == -1 || fcntl(s->fd, F_SETFL, O_NONBLOCK) == -1 ||
+	    epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->fd, &ev) == -1)
 	{
-		perror("read failed");
+		perror("failed to set up the socket server");
 		exit(EXIT_FAILURE);
 	}
-	runMsg(pie, msg, clientfd);
-	if (close(clientfd) == -1)
+}
+
+static void
+serverDrop(struct Server *s, uint32_t i)
+{
+	for (size_t f = 0; f < s->clients[i]->nfds; f++)
+		close(s->clients[i]->fds[f]);
+	epoll_ctl(s->epfd, EPOLL_CTL_DEL, s->clients[i]->fd, NULL);
+	close(s->clients[i]->fd);
+	free(s->clients[i]);
+	s->clients[i] = NULL;
+}
+
+static void
+serverStop(struct Server *s)
+{
+	for (uint32_t i = 0; i < SERVER_CLIENTS; i++)
+		if (s->clients[i] != NULL)
+			serverDrop(s, i);
+	close(s->epfd);
+	close(s->fd);
+}
+
+static void
+serverAccept(struct Server *s)
+{
+	for (;;)
+	{
+		int fd = accept(s->fd, NULL, NULL);
+		if (fd == -1 && errno == EINTR)
+			continue;
+		if (fd == -1)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				statusPerror("accept failed");
+			return;
+		}
+
+		uint32_t i = 0;
+		while (i < SERVER_CLIENTS && s->clients[i] != NULL)
+			i++;
+		struct Client *c = NULL;
+		if (i < SERVER_CLIENTS)
+			c = calloc(1, sizeof *c);
+		struct epoll_event ev = {EPOLLIN, {.u32 = i}};
+		if (c == NULL || fcntl(fd, F_SETFL, O_NONBLOCK) == -1 ||
+		    epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+		{
+			statusPrint("refusing client\n");
+			free(c);
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+		c->events = EPOLLIN;
+		c->id = ++s->lastId;
+		s->clients[i] = c;
+	}
+}
+
+/* watches c for input while it has room for it & is not waiting for a
+ * save, & for the socket to become writable while replies are left. hang
+ * ups are reported even when nothing is watched, so a client watched for
+ * nothing leaves epoll until it is again. false on errors */
+static bool
+clientWatch(struct Server *s, uint32_t i)
+{
+	struct Client *c = s->clients[i];
+	uint32_t events = 0;
+	if (!c->eof && !c->bad && !c->saving && c->inLen < sizeof c->in &&
+	    c->nfds < CLIENT_FDS)
+		events |= EPOLLIN;
+	if (c->outLen > 0)
+		events |= EPOLLOUT;
+	if (events == c->events)
+		return true;
+
+	int op = EPOLL_CTL_MOD;
+	if (events == 0)
+		op = EPOLL_CTL_DEL;
+	else if (c->events == 0)
+		op = EPOLL_CTL_ADD;
+	struct epoll_event ev = {events, {.u32 = i}};
+	c->events = events;
+	return epoll_ctl(s->epfd, op, c->fd, &ev) != -1;
+}
+
+/* writes as much of the queued replies as the socket takes, waiting for
+ * it to become writable for the rest. false on errors */
+static bool
+clientFlush(struct Server *s, uint32_t i)
+{
+	struct Client *c = s->clients[i];
+	size_t done = 0;
+	while (done < c->outLen)
+	{
+		/* a client hanging up must not raise SIGPIPE */
+		ssize_t n = send(c->fd,
+				 c->out + done,
+				 c->outLen - done,
+				 MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (n == -1)
+			return false;
+		done += (size_t)n;
+	}
+	memmove(c->out, c->out + done, c->outLen - done);
+	c->outLen -= done;
+	return clientWatch(s, i);
+}
+
+/* queues the fds passed in h */
+static void
+clientTakeFds(struct Client *c, struct cmsghdr *h)
+{
+	size_t n = (h->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	for (size_t i = 0; i < n; i++)
+	{
+		int fd;
+		memcpy(&fd, CMSG_DATA(h) + i * sizeof fd, sizeof fd);
+		if (c->nfds < CLIENT_FDS)
+			c->fds[c->nfds++] = fd;
+		else
+		{
+			close(fd);
+			c->bad = true;
+		}
+	}
+}
+
+/* reads until the socket is drained or the input buffer is full */
+static void
+clientRead(struct Client *c)
+{
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(CLIENT_FDS * sizeof(int))];
+	} ctl;
+
+	/* the kernel returns the fds of one send per read at most, so a full
+	 * fd queue waits for messages to take some */
+	while (c->inLen < sizeof c->in && c->nfds < CLIENT_FDS && !c->eof &&
+	       !c->bad)
+	{
+		struct iovec iov = {c->in + c->inLen, sizeof c->in - c->inLen};
+		struct msghdr mh = {
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = ctl.buf,
+			.msg_controllen = sizeof ctl.buf,
+		};
+		ssize_t n = recvmsg(c->fd, &mh, MSG_CMSG_CLOEXEC);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		/* errors end the connection like hanging up does */
+		c->eof = n <= 0;
+		if (n > 0)
+			c->inLen += (size_t)n;
+
+		for (struct cmsghdr *h = CMSG_FIRSTHDR(&mh); h != NULL;
+		     h = CMSG_NXTHDR(&mh, h))
+			if (h->cmsg_level == SOL_SOCKET &&
+			    h->cmsg_type == SCM_RIGHTS)
+				clientTakeFds(c, h);
+		/* fds that did not fit were closed by the kernel */
+		if (mh.msg_flags & MSG_CTRUNC)
+			c->bad = true;
+	}
+}
+
+static inline bool
+clientHasMsg(const struct Client *c)
+{
+	size_t left = c->inLen - c->inPos;
+	if (c->bad || c->saving || left < sizeof(struct Msg))
+		return false;
+	struct Msg m;
+	memcpy(&m, c->in + c->inPos, sizeof m);
+	return left >= sizeof m + msgPayload(m.id);
+}
+
+/* runs the next buffered message of c */
+static void
+clientRun(struct pie *pie, struct Client *c)
+{
+	struct Msg m;
+	memcpy(&m, c->in + c->inPos, sizeof m);
+	const unsigned char *payload = c->in + c->inPos + sizeof m;
+	c->inPos += sizeof m + msgPayload(m.id);
+	c->bad = !runMsg(pie, c, m, payload);
+}
+
+/* makes room for more input & sends the replies. drops the client if it
+ * misbehaved or hung up & has nothing left to run */
+static void
+clientSettle(struct Server *s, uint32_t i)
+{
+	struct Client *c = s->clients[i];
+	memmove(c->in, c->in + c->inPos, c->inLen - c->inPos);
+	c->inLen -= c->inPos;
+	c->inPos = 0;
+
+	/* fds no message is waiting for would stop reading for good */
+	bool stuck = c->nfds == CLIENT_FDS && !c->saving && !clientHasMsg(c);
+	if (c->bad || stuck || !clientFlush(s, i) ||
+	    (c->eof && !c->saving && !clientHasMsg(c)))
+		serverDrop(s, i);
+}
+
+/* accepts & reads from clients, then runs their messages for at most
+ * UI_SOCK_BUDGET seconds. returns whether messages are left to run */
+static bool
+serverService(struct pie *pie)
+{
+	struct Server *s = &pie->server;
+	struct epoll_event evs[SERVER_CLIENTS + 1];
+	int n = epoll_wait(s->epfd, evs, SERVER_CLIENTS + 1, 0);
+	if (n == -1 && errno != EINTR)
+	{
+		statusPerror("epoll_wait failed");
+		return false;
+	}
+
+	for (int e = 0; e < n; e++)
 	{
-		perror("close failed");
+		uint32_t i = evs[e].data.u32;
+		if (i == SERVER_CLIENTS)
+			serverAccept(s);
+		else if (evs[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+			clientRead(s->clients[i]);
+		if (i < SERVER_CLIENTS && evs[e].events & EPOLLOUT &&
+		    !clientFlush(s, i))
+			serverDrop(s, i);
+	}
+
+	/* one message per client & round, so a busy client cannot starve
+	 * the rest */
+	double deadline = glfwGetTime() + UI_SOCK_BUDGET;
+	for (bool more = true; more && glfwGetTime() < deadline;)
+	{
+		more = false;
+		for (uint32_t i = 0; i < SERVER_CLIENTS; i++)
+		{
+			struct Client *c = s->clients[i];
+			if (c != NULL && clientHasMsg(c))
+			{
+				clientRun(pie, c);
+				more = true;
+			}
+		}
+	}
+
+	bool left = false;
+	for (uint32_t i = 0; i < SERVER_CLIENTS; i++)
+		if (s->clients[i] != NULL)
+		{
+			clientSettle(s, i);
+			left |= s->clients[i] != NULL &&
+				clientHasMsg(s->clients[i]);
+		}
+	return left;
+}
+
+static void *
+watcherRun(void *data)
+{
+	struct Watcher *w = data;
+	for (;;)
+	{
+		struct pollfd pfd = {w->fd, POLLIN, 0};
+		if (poll(&pfd, 1, -1) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			statusPerror("watcher poll failed");
+			return NULL;
+		}
+
+		pthread_mutex_lock(&w->mutex);
+		w->pending = true;
+		glfwPostEmptyEvent();
+		while (w->pending)
+			pthread_cond_wait(&w->cond, &w->mutex);
+		pthread_mutex_unlock(&w->mutex);
+	}
+}
+
+static inline void
+watcherStart(struct Watcher *w, int fd)
+{
+	w->fd = fd;
+	pthread_mutex_init(&w->mutex, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	if (pthread_create(&w->thread, NULL, watcherRun, w) != 0)
+	{
+		fprintf(stderr, "failed to start socket watcher\n");
 		exit(EXIT_FAILURE);
 	}
 }
 
+/* lets the watcher poll again once the server was serviced */
+static inline void
+watcherResume(struct Watcher *w)
+{
+	pthread_mutex_lock(&w->mutex);
+	if (w->pending)
+	{
+		w->pending = false;
+		pthread_cond_signal(&w->cond);
+	}
+	pthread_mutex_unlock(&w->mutex);
+}
+
 static inline void
-sampleImg(struct Image i, int x, int y, struct ColorRGBA *out)
+watcherStop(struct Watcher *w)
+{
+	pthread_cancel(w->thread);
+	pthread_join(w->thread, NULL);
+}
+
+/* draws the queued cursor path with the buttons held until now */
+static void
+cursorDrain(struct pie *pie)
+{
+	struct CursorQueue *q = &pie->cursor;
+	for (; q->n > 0; q->n--, q->head = (q->head + 1) % CURSOR_QUEUE)
+	{
+		pie->lastM = pie->m;
+		pie->m = q->p[q->head];
+		if (pie->m0Down)
+			mouseDown(pie, pie->lastM, pie->m);
+		if (pie->m1Down)
+			mouse2Down(pie, pie->lastM, pie->m);
+		if (pie->m2Down)
+		{
+			pie->canvas.r.pos.x += pie->m.x - pie->lastM.x;
+			pie->canvas.r.pos.y += pie->m.y - pie->lastM.y;
+			pie->canvas.fit = false;
+		}
+	}
+	if (pie->m2Down)
+	{
+		canvasView(&pie->canvas, pie->win);
+		pie->redraw = true;
+	}
+}
+
+static void
+cbCursorPos(GLFWwindow *window, double x, double y)
 {
-	if (BOUNDS_ZERO(x, y, i.w, i.h))
-		*out = i.data[x + y * i.w];
+	struct pie *pie = glfwGetWindowUserPointer(window);
+	struct CursorQueue *q = &pie->cursor;
+
+	/* when full, the newest position replaces the last one, which only
+	 * straightens the end of the path */
+	if (q->n == CURSOR_QUEUE)
+		q->n--;
+	q->p[(q->head + q->n++) % CURSOR_QUEUE] = (struct Vec2f){x, y};
 }
 
 static void
@@ -639,18 +2520,54 @@ cbMouse(GLFWwindow *window, int mb, int action, int mod)
 	struct pie *pie = glfwGetWindowUserPointer(window);
 
 	glfwMakeContextCurrent(window);
+	/* the path so far belongs to the previous button state */
+	cursorDrain(pie);
 
 	pie->m0Down = mb == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS;
 	pie->m1Down = mb == GLFW_MOUSE_BUTTON_RIGHT && action == GLFW_PRESS;
+	pie->m2Down = mb == GLFW_MOUSE_BUTTON_MIDDLE && action == GLFW_PRESS;
+	pie->redraw = true;
+	bool drawing = pie->m0Down || pie->m1Down;
+	glfwSwapInterval(drawing ? UI_DRAW_SWAP_INTERVAL : 0);
+
+	/* an eraser stroke is undone as a whole */
+	if (mb == GLFW_MOUSE_BUTTON_RIGHT && action == GLFW_PRESS)
+	{
+		histBegin(&pie->canvas.hist);
+		mouse2Down(pie, pie->m, pie->m);
+	}
+	if (mb == GLFW_MOUSE_BUTTON_RIGHT && action == GLFW_RELEASE)
+		histEnd(&pie->canvas.hist);
 	if (mb != GLFW_MOUSE_BUTTON_LEFT)
 		return;
 
 	if (action == GLFW_PRESS)
+	{
 		mouseJustDown(pie);
+		mouseDown(pie, pie->m, pie->m);
+	}
 	if (action == GLFW_RELEASE)
 		mouseJustUp(pie);
 }
 
+static void
+cbScroll(GLFWwindow *window, double x, double y)
+{
+	(void)x;
+	struct pie *pie = glfwGetWindowUserPointer(window);
+	if (y == 0)
+		return;
+
+	glfwMakeContextCurrent(window);
+	/* zoom around where the cursor is now, not where it was */
+	cursorDrain(pie);
+	canvasZoom(&pie->canvas,
+		   pie->win,
+		   pie->m,
+		   y > 0 ? UI_ZOOM_STEP : 1 / UI_ZOOM_STEP);
+	pie->redraw = true;
+}
+
 static void
 cbKeyboard(GLFWwindow *window, int key, int scan, int action, int mod)
 {
@@ -658,8 +2575,9 @@ cbKeyboard(GLFWwindow *window, int key, int scan, int action, int mod)
 
 	glfwMakeContextCurrent(window);
 	struct pie *pie = glfwGetWindowUserPointer(window);
+	pie->redraw = true;
 	if (key == KEY_COLOR_PALETTE && action == GLFW_RELEASE)
-		runCmd(colorPickCmd);
+		pickerShow(pie);
 	if (key == KEY_AREA_SELECT && action == GLFW_PRESS)
 	{
 		if (pie->area.selecting)
@@ -675,21 +2593,32 @@ cbKeyboard(GLFWwindow *window, int key, int scan, int action, int mod)
 		areaAbort(&pie->area);
 		pie->area.r = (struct Recti){{0, 0}, {0, 0}};
 	}
+	struct Canvas *c = &pie->canvas;
 	if (key == KEY_AREA_FILL && action == GLFW_PRESS)
-	{
-		imageFill(pie->canvas.img, pie->area.r, pie->color);
-		glBindTexture(GL_TEXTURE_2D, pie->canvas.imgTex);
-		grImageUpdate(pie->canvas.img);
-	}
+		editFill(c, pie->area.r, pie->color);
+	if (key == KEY_UNDO && action != GLFW_RELEASE)
+		editUndo(c, false);
+	if (key == KEY_REDO && action != GLFW_RELEASE)
+		editUndo(c, true);
 	if (key == KEY_SAMPLE && action != GLFW_RELEASE)
 	{
-		struct Vec2f rs = mtScreen2Canvas(pie->m, &pie->canvas);
-		sampleImg(pie->canvas.img, (int)rs.x, (int)rs.y, &pie->color);
+		struct Vec2f rs = mtScreen2Canvas(pie->m, c);
+		canvasSync(c, (struct Recti){{(int)rs.x, (int)rs.y}, {1, 1}});
+		sampleImg(c->img, (int)rs.x, (int)rs.y, &pie->color);
 	}
 	if (key == KEY_BRUSH_DEC_SIZE && action != GLFW_RELEASE)
 		pie->brushSize--;
 	if (key == KEY_BRUSH_INC_SIZE && action != GLFW_RELEASE)
 		pie->brushSize++;
+	if (key == KEY_VIEW_FIT && action == GLFW_PRESS)
+	{
+		canvasAlign(c, pie->win);
+		canvasView(c, pie->win);
+	}
+	if (key == KEY_BRUSH_SHAPE && action == GLFW_PRESS)
+		pie->brushShape = pie->brushShape == BRUSH_SQUARE
+					  ? BRUSH_ROUND
+					  : BRUSH_SQUARE;
 	if (key == KEY_QUIT_NOSAVE && action != GLFW_RELEASE &&
 	    mod == GLFW_MOD_SHIFT)
 	{
@@ -704,116 +2633,425 @@ cbWinSize(struct GLFWwindow *window, int w, int h)
 	struct pie *pie = glfwGetWindowUserPointer(window);
 	pie->win = (struct Vec2i){w, h};
 	glViewport(0, 0, w, h);
-	canvasAlign(&pie->canvas, pie->win);
-	glUseProgram(pie->canvas.sh.id);
-	grImgUpdate(&pie->canvas.sh, pie->canvas.r, w, h);
-	glUseProgram(pie->canvas.bgSh.id);
-	grImgUpdate(&pie->canvas.bgSh, pie->canvas.r, w, h);
+	if (pie->canvas.fit)
+		canvasAlign(&pie->canvas, pie->win);
+	canvasView(&pie->canvas, pie->win);
+	pie->redraw = true;
+}
+
+static void
+cbRefresh(struct GLFWwindow *window)
+{
+	struct pie *pie = glfwGetWindowUserPointer(window);
+	pie->redraw = true;
+}
+
+/* writes the status line if it changed, at most UI_STATUS_RATE times a
+ * second. returns how long the loop may sleep before calling again */
+static double
+statusUpdate(struct pie *pie)
+{
+	struct Vec2f rs = mtScreen2Canvas(pie->m, &pie->canvas);
+	char line[sizeof pie->status.shown];
+	snprintf(line,
+		 sizeof line,
+		 "%dx%d \tsize %.1f %s\t%.1f\t%.1f\tcolor "
+		 "%02x%02x%02x%02x\tarea%c%d,%d%c%dx%d",
+		 pie->canvas.img.w,
+		 pie->canvas.img.h,
+		 pie->brushSize,
+		 pie->brushShape == BRUSH_ROUND ? "round" : "square",
+		 rs.x,
+		 rs.y,
+		 pie->color.r,
+		 pie->color.g,
+		 pie->color.b,
+		 pie->color.a,
+		 pie->area.selecting && !pie->area.pointSet ? '>' : ' ',
+		 pie->area.r.pos.x,
+		 pie->area.r.pos.y,
+		 pie->area.selecting && pie->area.pointSet ? '>' : ' ',
+		 pie->area.r.size.x,
+		 pie->area.r.size.y);
+
+	if (strcmp(line, pie->status.shown) == 0)
+		return UI_IDLE_TIMEOUT;
+
+	double now = glfwGetTime();
+	double rate = statusTty ? UI_STATUS_RATE : UI_STATUS_LOG_RATE;
+	double next = pie->status.shownAt + 1. / rate;
+	if (now < next)
+		return next - now;
+
+	if (statusTty)
+		fprintf(stderr, "\r\033[K%s", line);
+	else
+		fprintf(stderr, "%s\n", line);
+	strcpy(pie->status.shown, line);
+	pie->status.shownAt = now;
+	return UI_IDLE_TIMEOUT;
+}
+
+static inline void
+draw(struct pie *pie, GLFWwindow *window)
+{
+	canvasFlush(&pie->canvas);
+	glClear(GL_COLOR_BUFFER_BIT);
+	struct Canvas *c = &pie->canvas;
+	canvasDraw(c, pie->win, pie->m0Down || !rectEmpty(c->stroke));
+
+	glUseProgram(0);
+	grDrawArea(&pie->area, &pie->canvas, pie->win);
+
+	glfwSwapBuffers(window);
+	pie->redraw = false;
+	if (!pie->shown)
+		statusPrint("first frame after %.1f ms\n",
+			    (mtNow() - pie->startedAt) * 1e3);
+	pie->shown = true;
 }
 
 static inline void
 run(struct pie *pie, GLFWwindow *window)
 {
 	glfwGetCursorPos(window, &pie->m.x, &pie->m.y);
+	bool busy = false;
 	while (!glfwWindowShouldClose(window) && !pie->quit)
 	{
-		pie->lastM.x = pie->m.x;
-		pie->lastM.y = pie->m.y;
-		glfwGetCursorPos(window, &pie->m.x, &pie->m.y);
-		struct Vec2f rs = mtScreen2Canvas(pie->m, &pie->canvas);
-		fprintf(stderr,
-			"\r\033[K%dx%d \tsize %.1f\t%.1f\t%.1f\tcolor "
-			"%02x%02x%02x%02x\tarea%c%d,%d%c%dx%d",
-			pie->canvas.img.w,
-			pie->canvas.img.h,
-			pie->brushSize,
-			rs.x,
-			rs.y,
-			pie->color.r,
-			pie->color.g,
-			pie->color.b,
-			pie->color.a,
-			pie->area.selecting && !pie->area.pointSet
-				? '>'
-				: ' ',
-			pie->area.r.pos.x,
-			pie->area.r.pos.y,
-			pie->area.selecting && pie->area.pointSet
-				? '>'
-				: ' ',
-			pie->area.r.size.x,
-			pie->area.r.size.y);
-		glClear(GL_COLOR_BUFFER_BIT);
-		glUseProgram(pie->canvas.bgSh.id);
-		glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
-		glUseProgram(pie->canvas.sh.id);
-		glBindTexture(GL_TEXTURE_2D, pie->canvas.imgTex);
-		glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
-
-		if (pie->m0Down)
-		{
-			glBindTexture(GL_TEXTURE_2D, pie->canvas.drwTex);
-			glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
-		}
-
-		glUseProgram(0);
-		grDrawArea(&pie->area, &pie->canvas, pie->win);
+		double timeout = statusUpdate(pie);
 
-		glfwSwapBuffers(window);
-		glfwPollEvents();
-		pollSock(pie);
+		if (pie->redraw || !rectEmpty(pie->canvas.imgDirty) ||
+		    !rectEmpty(pie->canvas.drwDirty))
+			draw(pie, window);
 
-		if (pie->m0Down)
-			mouseDown(pie, pie->lastM, pie->m);
-		if (pie->m1Down)
-			mouse2Down(pie, pie->lastM, pie->m);
+		/* messages left over from the last frame run right away */
+		if (busy)
+			glfwPollEvents();
+		else
+			glfwWaitEventsTimeout(timeout);
+		loaderPoll(pie, false);
+		saverPoll(pie);
+		busy = serverService(pie);
+		watcherResume(&pie->watcher);
+		cursorDrain(pie);
+		childrenReap(pie);
 	}
 }
 
-static inline void
+/* frees everything. false if the image could not be written to stdout */
+static inline bool
 quit(struct pie *pie)
 {
-	fputc('\n', stderr);
-	if (pie->useStdout)
-		ffwrite(stdout, pie->canvas.img);
-	glDeleteTextures(1, &pie->canvas.imgTex);
-	glDeleteTextures(1, &pie->canvas.drwTex);
+	if (statusTty)
+		fputc('\n', stderr);
+	struct Canvas *c = &pie->canvas;
+	/* the output is the whole image */
+	while (pie->useStdout && pie->loader.running)
+		loaderPoll(pie, true);
+	loaderStop(&pie->loader);
+	saverStop(pie, mtNow() + SAVE_QUIT_WAIT);
+	for (uint32_t i = 0; i < SERVER_CLIENTS; i++)
+		if (pie->server.clients[i] != NULL)
+			clientFlush(&pie->server, i);
+	canvasSync(c, (struct Recti){{0, 0}, {c->img.w, c->img.h}});
+	bool ok = !pie->useStdout || ffwrite(STDOUT_FILENO, pie->canvas.img);
+	grTilesFree(&pie->canvas.imgTex);
+	grTilesFree(&pie->canvas.drwTex);
+	grUploaderFree(&pie->canvas.up);
 	glDeleteVertexArrays(1, &pie->canvas.vao);
 	glDeleteProgram(pie->canvas.sh.id);
-	glDeleteProgram(pie->canvas.bgSh.id);
+	if (pie->canvas.gpu)
+		grPaintFree(&pie->canvas.paint);
 	glfwTerminate();
-	free(pie->canvas.img.data);
-	free(pie->canvas.drw.data);
-	close(pie->sockfd);
+	histFree(&pie->canvas.hist);
+	brushFree(&pie->brush);
+	imgFree(&pie->canvas.img);
+	imgFree(&pie->canvas.drw);
+	imgFree(&pie->canvas.sockDrw);
+	serverStop(&pie->server);
+	shmStop(&pie->canvas, pie->shmName);
+	if (pie->picker > 0 && kill(pie->picker, SIGTERM) == 0)
+		waitpid(pie->picker, NULL, 0);
+	return ok;
+}
+
+/* reads x y pairs until the end of str, clamped to the canvas. returns the
+ * number of points or -1 if str is not only points */
+static int
+scriptPoints(struct pie *pie, char *str, struct Vec2i *out, int max)
+{
+	int n = 0;
+	for (;;)
+	{
+		char *xe, *ye;
+		long x = strtol(str, &xe, 10);
+		if (xe == str)
+			break;
+		long y = strtol(xe, &ye, 10);
+		if (ye == xe || n == max)
+			return -1;
+		str = ye;
+
+		out[n++] = canvasClamp(&pie->canvas, x, y);
+	}
+
+	str += strspn(str, " \t\r\n");
+	return *str == '\0' ? n : -1;
+}
+
+/* runs one script command. false if it is invalid */
+static bool
+scriptLine(struct pie *pie, char *line)
+{
+	char cmd[16], tail;
+	int skip;
+	if (sscanf(line, "%15s%n", cmd, &skip) != 1 || cmd[0] == '#')
+		return true;
+	char *args = line + skip;
+	struct Canvas *c = &pie->canvas;
+
+	if (strcmp(cmd, "color") == 0)
+	{
+		unsigned long v;
+		if (sscanf(args, "%8lx %c", &v, &tail) != 1)
+			return false;
+		pie->color = (struct ColorRGBA){(unsigned char)(v >> 24),
+						(unsigned char)(v >> 16),
+						(unsigned char)(v >> 8),
+						(unsigned char)v};
+		return true;
+	}
+	if (strcmp(cmd, "size") == 0)
+		return sscanf(args, "%lf %c", &pie->brushSize, &tail) == 1;
+	if (strcmp(cmd, "shape") == 0)
+	{
+		char shape[8];
+		if (sscanf(args, "%7s %c", shape, &tail) != 1)
+			return false;
+		if (strcmp(shape, "square") == 0)
+			pie->brushShape = BRUSH_SQUARE;
+		else if (strcmp(shape, "round") == 0)
+			pie->brushShape = BRUSH_ROUND;
+		else
+			return false;
+		return true;
+	}
+	if (strcmp(cmd, "fill") == 0)
+	{
+		struct Recti r;
+		if (sscanf(args,
+			   "%d %d %d %d %c",
+			   &r.pos.x,
+			   &r.pos.y,
+			   &r.size.x,
+			   &r.size.y,
+			   &tail) != 4)
+			return false;
+		editFill(c, r, pie->color);
+		return true;
+	}
+	if (strcmp(cmd, "sample") == 0)
+	{
+		int x, y;
+		if (sscanf(args, "%d %d %c", &x, &y, &tail) != 2)
+			return false;
+		sampleImg(c->img, x, y, &pie->color);
+		return true;
+	}
+	if (strcmp(cmd, "undo") == 0 || strcmp(cmd, "redo") == 0)
+	{
+		if (sscanf(args, " %c", &tail) == 1)
+			return false;
+		editUndo(c, cmd[0] == 'r');
+		return true;
+	}
+
+	bool pencil = strcmp(cmd, "stroke") == 0;
+	if (!pencil && strcmp(cmd, "erase") != 0)
+		return false;
+
+	struct Vec2i p[SCRIPT_LINE / 4];
+	int n = scriptPoints(pie, args, p, SCRIPT_LINE / 4);
+	if (n < 1)
+		return false;
+	if (!pencil)
+		histBegin(&c->hist);
+	for (int i = 0; i < n; i++)
+	{
+		struct Vec2i v0 = p[i > 0 ? i - 1 : 0];
+		if (pencil)
+			editPencil(pie, pie->color, v0, p[i]);
+		else
+			editErase(pie, v0, p[i]);
+	}
+	if (pencil)
+		editCommit(c);
+	else
+		histEnd(&c->hist);
+	return true;
+}
+
+/* runs the script read from fd line by line. prints the failing line */
+static bool
+scriptRun(struct pie *pie, int fd, const char *name)
+{
+	char buf[SCRIPT_LINE + 1];
+	size_t len = 0;
+	bool eof = false;
+	int ln = 0;
+	while (!eof || len > 0)
+	{
+		char *nl = memchr(buf, '\n', len);
+		if (nl == NULL && !eof && len < SCRIPT_LINE)
+		{
+			ssize_t n = read(fd, buf + len, SCRIPT_LINE - len);
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n == -1)
+			{
+				perror("failed to read script");
+				return false;
+			}
+			eof = n == 0;
+			len += (size_t)n;
+			continue;
+		}
+		ln++;
+		if (nl == NULL && !eof)
+		{
+			fprintf(stderr, "%s:%d: line too long\n", name, ln);
+			return false;
+		}
+
+		size_t end = nl != NULL ? (size_t)(nl - buf) : len;
+		buf[end] = '\0';
+		if (!scriptLine(pie, buf))
+		{
+			fprintf(stderr,
+				"%s:%d: invalid command %s\n",
+				name,
+				ln,
+				buf);
+			return false;
+		}
+
+		size_t used = nl != NULL ? end + 1 : len;
+		memmove(buf, buf + used, len - used);
+		len -= used;
+	}
+	return true;
+}
+
+/* edits without a window or gl context. the script comes from a file or
+ * from the first client of the socket given with -sock, never the one of an
+ * interactive pie, & the result goes to stdout */
+static int
+headless(struct pie *pie)
+{
+	const char *name = pie->scriptPath;
+	int fd;
+	/* nothing to stamp with, -gpu paints on the cpu like without gl 3.3 */
+	pie->canvas.gpu = false;
+	if (name != NULL)
+		fd = open(name, O_RDONLY);
+	else if (pie->sockPath == NULL)
+	{
+		fprintf(stderr, "-headless needs -s script or -sock path\n");
+		return EXIT_FAILURE;
+	} else
+	{
+		int sockfd;
+		setupSock(pie->sockPath, &sockfd);
+		name = pie->sockPath;
+		fd = accept(sockfd, NULL, NULL);
+		close(sockfd);
+	}
+	if (fd == -1)
+	{
+		perror(name);
+		return EXIT_FAILURE;
+	}
+
+	bool ok = scriptRun(pie, fd, name);
+	close(fd);
+	if (ok)
+		ok = ffwrite(STDOUT_FILENO, pie->canvas.img);
+
+	histFree(&pie->canvas.hist);
+	brushFree(&pie->brush);
+	imgFree(&pie->canvas.img);
+	imgFree(&pie->canvas.drw);
+	imgFree(&pie->canvas.sockDrw);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 int
 main(int argc, char **argv)
 {
 	struct pie pie = {0};
+	pie.startedAt = mtNow();
 	pie.win = (struct Vec2i){800, 800};
-	pie.canvas.img = (struct Image){0, 32, 32};
-	pie.canvas.drw = (struct Image){0, 32, 32};
+	pie.canvas.img = (struct Image){0, 32, 32, 0, 0};
+	pie.canvas.drw = (struct Image){0, 32, 32, 0, 0};
 	pie.color = (struct ColorRGBA){0xff, 0, 0, 0xff};
 	pie.brushSize = 1;
+	pie.brushShape = UI_BRUSH_SHAPE;
+	statusTty = isatty(STDERR_FILENO);
+	/* a reader that goes away fails the save or the -o write, it does not
+	 * kill pie */
+	signal(SIGPIPE, SIG_IGN);
 
 	parseArguments(&pie, argc, argv);
 	loadInputFile(&pie);
-	setupSock(socketPath, &pie.sockfd);
+	if (!histInit(&pie.canvas.hist, pie.canvas.img, HISTORY_BUDGET))
+	{
+		perror("calloc failed");
+		return EXIT_FAILURE;
+	}
+	if (pie.headless)
+		return headless(&pie);
+	if (pie.shmName != NULL && !shmStart(&pie.canvas, pie.shmName))
+		return EXIT_FAILURE;
+	if (pie.sockPath == NULL)
+		pie.sockPath = socketPath;
+	serverStart(&pie.server, pie.sockPath);
 
 	GLFWwindow *window;
 	if (!grInit(&pie, &window, pie.win, 1, cbMouse, cbKeyboard, cbWinSize))
 		return EXIT_FAILURE;
+	loaderWake(&pie.loader);
 
 	canvasAlign(&pie.canvas, pie.win);
 	pie.canvas.vao = grImgGenVAO();
-	grImageGenTexture(pie.canvas.img, &pie.canvas.imgTex);
-	grImageGenTexture(pie.canvas.img, &pie.canvas.drwTex);
+	if (!grTilesGen(&pie.canvas.imgTex, pie.canvas.img) ||
+	    !grTilesGen(&pie.canvas.drwTex, pie.canvas.drw))
+	{
+		perror("calloc failed");
+		return EXIT_FAILURE;
+	}
+	grUploaderInit(&pie.canvas.up);
+	/* textures start out undefined */
+	struct Recti all = {{0, 0}, {pie.canvas.img.w, pie.canvas.img.h}};
+	pie.canvas.imgDirty = all;
+	pie.canvas.drwDirty = all;
 	grImgInitGr(&pie.canvas.sh, canvasFragSrc);
-	grImgInitGr(&pie.canvas.bgSh, bgFragSrc);
+	unsigned int sh = pie.canvas.sh.id;
+	glUniform1i(glGetUniformLocation(sh, "drw"), 1);
+	pie.canvas.uShowDrw = glGetUniformLocation(sh, "uShowDrw");
+	if (pie.canvas.gpu && !GLEW_VERSION_3_3)
+	{
+		fprintf(stderr, "-gpu needs gl 3.3, painting on the cpu\n");
+		pie.canvas.gpu = false;
+	}
+	if (pie.canvas.gpu)
+		grPaintInit(&pie.canvas.paint);
 	cbWinSize(window, pie.win.x, pie.win.y);
+	glfwSetWindowRefreshCallback(window, cbRefresh);
+	glfwSetCursorPosCallback(window, cbCursorPos);
+	glfwSetScrollCallback(window, cbScroll);
+	watcherStart(&pie.watcher, pie.server.epfd);
 
 	run(&pie, window);
-	quit(&pie);
-	return EXIT_SUCCESS;
+	watcherStop(&pie.watcher);
+	return quit(&pie) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
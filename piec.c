@@ -5,10 +5,14 @@
 
 piec: communicate with a pie instance via a unix domain socket */
 
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
@@ -17,8 +21,52 @@ struct ColorRGBA {
 	unsigned char r, g, b, a;
 };
 
+#include "ff.h"
 #include "msg.h"
 
+/* commands sent ahead of their replies in batch mode */
+#define BATCH_PENDING 256
+/* memfds sent ahead of their messages being run. must not exceed what pie
+ * accepts */
+#define BATCH_FDS 8
+#define BATCH_LINE 4096
+#define BATCH_OUT 16384
+#define BATCH_REPLY 4096
+#define BATCH_ARGS 8
+
+/* a parsed command, kept until its reply is handled */
+struct Cmd {
+	struct Msg m;
+	unsigned char payload[sizeof(struct MsgRect)];
+	/* memfd or file to send with the message, or -1 */
+	int memfd;
+	/* the region & its mapping for getregion & putregion */
+	struct MsgRect r;
+	struct ColorRGBA *px;
+	/* where getregion writes the image */
+	int out;
+};
+
+/* commands are encoded into out & sent as the socket takes them. every
+ * memfd is sent alone with the bytes up to the end of its message, since pie
+ * only accepts a few memfds ahead of their messages */
+struct Batch {
+	int fd;
+	bool lines, eof, ok;
+	size_t line;
+	char in[BATCH_LINE];
+	size_t inLen;
+	unsigned char out[BATCH_OUT];
+	size_t outLen;
+	int fds[BATCH_FDS];
+	size_t fdEnd[BATCH_FDS], nfds;
+	bool fdSent;
+	struct Cmd pending[BATCH_PENDING];
+	size_t head, n;
+	unsigned char reply[BATCH_REPLY];
+	size_t replyLen;
+};
+
 static bool
 stobyte(const char *str, uint8_t *out)
 {
@@ -67,14 +115,576 @@ storgba(const char *str, struct ColorRGBA *out)
 	return true;
 }
 
+static bool
+stoint(const char *str, int32_t *out)
+{
+	char *end;
+	long n = strtol(str, &end, 10);
+	if (end == str || *end != '\0' || n < INT32_MIN || n > INT32_MAX)
+		return false;
+	*out = (int32_t)n;
+	return true;
+}
+
+/* parses count integers from argv into out */
+static bool
+stoints(char **argv, int32_t *out, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+		if (!stoint(argv[i], &out[i]))
+		{
+			fprintf(stderr, "Failed to parse number %s\n", argv[i]);
+			return false;
+		}
+	return true;
+}
+
+/* a memfd of w * h pixels, mapped to *px. pie only maps memfds sealed
+ * against shrinking */
+static int
+regionAlloc(int32_t w, int32_t h, struct ColorRGBA **px)
+{
+	if (w <= 0 || h <= 0)
+	{
+		fprintf(stderr, "Invalid region size %dx%d\n", (int)w, (int)h);
+		return -1;
+	}
+	size_t len = (size_t)w * (size_t)h * sizeof **px;
+	int fd = memfd_create("pie-region", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd == -1)
+	{
+		perror("memfd_create failed");
+		return -1;
+	}
+	if (ftruncate(fd, (off_t)len) == -1)
+	{
+		perror("ftruncate failed");
+		close(fd);
+		return -1;
+	}
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) == -1)
+	{
+		perror("sealing the memfd failed");
+		close(fd);
+		return -1;
+	}
+	void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+	{
+		perror("mmap failed");
+		close(fd);
+		return -1;
+	}
+	*px = p;
+	return fd;
+}
+
+static void
+cmdFree(struct Cmd *c)
+{
+	if (c->px != NULL)
+		munmap(c->px, (size_t)c->r.w * (size_t)c->r.h * sizeof *c->px);
+	if (c->memfd != -1)
+		close(c->memfd);
+	if (c->out != -1 && c->out != STDOUT_FILENO)
+		close(c->out);
+}
+
+/* the region & memfd of getregion & putregion. the image of putregion is
+ * read from in */
+static bool
+cmdRegion(struct Cmd *c, struct MsgRect r, FILE *in)
+{
+	c->r = r;
+	c->memfd = regionAlloc(r.w, r.h, &c->px);
+	if (c->memfd == -1)
+		return false;
+	memcpy(c->payload, &r, sizeof r);
+	return in == NULL ||
+	       ffreadBody(in, c->px, (size_t)r.w * (size_t)r.h);
+}
+
+/* parses a command. files given to getregion, putregion & save are opened
+ * here.
+ * lines tells if stdin holds the commands rather than an image */
+static bool
+cmdParse(struct Cmd *c, int argc, char **argv, bool lines)
+{
+	*c = (struct Cmd){.memfd = -1, .out = -1};
+	int32_t v[4];
+
+	if (strcmp(argv[0], "setcolor") == 0)
+	{
+		if (argc != 2)
+		{
+			fprintf(stderr, "Missing color for setcolor\n");
+			return false;
+		}
+		c->m.id = MSG_SET_COLOR;
+		if (!storgba(argv[1], &c->m.data.color))
+		{
+			fprintf(stderr, "Failed to parse color %s\n", argv[1]);
+			return false;
+		}
+		return true;
+	}
+
+	if (strcmp(argv[0], "getcolor") == 0)
+	{
+		c->m.id = MSG_GET_COLOR;
+		return true;
+	}
+
+	if (strcmp(argv[0], "fill") == 0 || strcmp(argv[0], "stroke") == 0)
+	{
+		bool fill = argv[0][0] == 'f';
+		c->m.id = fill ? MSG_FILL_RECT : MSG_STROKE;
+		if (argc != 6)
+		{
+			fprintf(stderr,
+				"Usage: %s\n",
+				fill ? "fill x y w h rrggbbaa"
+				     : "stroke x0 y0 x1 y1 rrggbbaa");
+			return false;
+		}
+		if (!stoints(argv + 1, v, 4))
+			return false;
+		if (!storgba(argv[5], &c->m.data.color))
+		{
+			fprintf(stderr, "Failed to parse color %s\n", argv[5]);
+			return false;
+		}
+		/* MsgRect & MsgStroke are both four int32_t */
+		memcpy(c->payload, v, sizeof v);
+		return true;
+	}
+
+	if (strcmp(argv[0], "getregion") == 0)
+	{
+		c->m.id = MSG_GET_REGION;
+		if (argc != 5 && argc != 6)
+		{
+			fprintf(stderr, "Usage: getregion x y w h [out.ff]\n");
+			return false;
+		}
+		if (!stoints(argv + 1, v, 4))
+			return false;
+		c->out = STDOUT_FILENO;
+		int flags = O_WRONLY | O_CREAT | O_TRUNC;
+		if (argc == 6 && (c->out = open(argv[5], flags, 0644)) == -1)
+		{
+			perror(argv[5]);
+			return false;
+		}
+		struct MsgRect r = {v[0], v[1], v[2], v[3]};
+		return cmdRegion(c, r, NULL);
+	}
+
+	if (strcmp(argv[0], "putregion") == 0)
+	{
+		c->m.id = MSG_PUT_REGION;
+		if ((argc != 3 && argc != 4) || (lines && argc != 4))
+		{
+			fprintf(stderr,
+				"Usage: putregion x y %s\n",
+				lines ? "in.ff" : "[in.ff]");
+			return false;
+		}
+		if (!stoints(argv + 1, v, 2))
+			return false;
+		FILE *in = argc == 4 ? fopen(argv[3], "rb") : stdin;
+		if (in == NULL)
+		{
+			perror(argv[3]);
+			return false;
+		}
+		int w, h;
+		bool ok = ffreadHeader(in, &w, &h) &&
+			  cmdRegion(c, (struct MsgRect){v[0], v[1], w, h}, in);
+		if (in != stdin)
+			fclose(in);
+		return ok;
+	}
+
+	if (strcmp(argv[0], "save") == 0)
+	{
+		c->m.id = MSG_SAVE;
+		if ((argc != 1 && argc != 2) || (lines && argc != 2))
+		{
+			fprintf(stderr,
+				"Usage: save %s\n",
+				lines ? "out.ff" : "[out.ff]");
+			return false;
+		}
+		/* pie writes to the file itself */
+		int flags = O_WRONLY | O_CREAT | O_TRUNC;
+		c->memfd = argc == 2 ? open(argv[1], flags, 0644)
+				     : dup(STDOUT_FILENO);
+		if (c->memfd == -1)
+		{
+			perror(argc == 2 ? argv[1] : "dup failed");
+			return false;
+		}
+		return true;
+	}
+
+	fprintf(stderr, "Unknown command: %s\n", argv[0]);
+	return false;
+}
+
+static inline size_t
+cmdReplySize(const struct Cmd *c)
+{
+	switch (c->m.id)
+	{
+	case MSG_GET_COLOR:
+		return sizeof(struct ColorRGBA);
+	case MSG_GET_REGION:
+		return sizeof(struct MsgRect);
+	case MSG_SAVE:
+		return sizeof(uint64_t);
+	default:
+		return 0;
+	}
+}
+
+/* prints the reply of getcolor, checks the one of save, or writes the part
+ * of the region that lies on the canvas as farbfeld */
+static bool
+cmdReply(struct Cmd *c, const unsigned char *reply, bool lines)
+{
+	if (c->m.id == MSG_SAVE)
+	{
+		uint64_t ok;
+		memcpy(&ok, reply, sizeof ok);
+		if (!ok)
+			fprintf(stderr, "Failed to save the image\n");
+		return ok != 0;
+	}
+
+	if (c->m.id == MSG_GET_COLOR)
+	{
+		struct ColorRGBA color;
+		memcpy(&color, reply, sizeof color);
+		printf("%02x%02x%02x%02x%s",
+		       color.r,
+		       color.g,
+		       color.b,
+		       color.a,
+		       lines ? "\n" : "");
+		return true;
+	}
+
+	struct MsgRect r = c->r, got;
+	memcpy(&got, reply, sizeof got);
+	if (got.w <= 0 || got.h <= 0)
+	{
+		fprintf(stderr, "Region lies outside the canvas\n");
+		return false;
+	}
+
+	/* packs the rows of the clipped region to the start of the
+	 * mapping. rows only move down, so none is overwritten early */
+	size_t gw = (size_t)got.w;
+	for (int32_t y = 0; y < got.h; y++)
+		memmove(c->px + (size_t)y * gw,
+			c->px + (size_t)(got.y - r.y + y) * (size_t)r.w +
+				(size_t)(got.x - r.x),
+			gw * sizeof *c->px);
+	fflush(stdout);
+	return ffwriteHeader(c->out, got.w, got.h) &&
+	       ffwriteBody(c->out, c->px, gw * (size_t)got.h);
+}
+
+/* queues the message of c. returns false if it does not fit yet */
+static bool
+batchPush(struct Batch *b, struct Cmd *c)
+{
+	size_t len = sizeof c->m + msgPayload(c->m.id);
+	if (b->outLen + len > sizeof b->out || b->n == BATCH_PENDING ||
+	    b->nfds == BATCH_FDS)
+		return false;
+
+	memcpy(b->out + b->outLen, &c->m, sizeof c->m);
+	memcpy(b->out + b->outLen + sizeof c->m,
+	       c->payload,
+	       msgPayload(c->m.id));
+	b->outLen += len;
+	if (c->memfd != -1)
+	{
+		b->fds[b->nfds] = c->memfd;
+		b->fdEnd[b->nfds++] = b->outLen;
+		c->memfd = -1;
+	}
+
+	if (cmdReplySize(c) > 0)
+		b->pending[(b->head + b->n++) % BATCH_PENDING] = *c;
+	else
+		cmdFree(c);
+	return true;
+}
+
+static ssize_t
+sendFd(int sock, const void *buf, size_t len, int fd)
+{
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+	struct iovec iov = {(void *)buf, len};
+	struct msghdr mh = {.msg_iov = &iov, .msg_iovlen = 1};
+	if (fd != -1)
+	{
+		mh.msg_control = ctl.buf;
+		mh.msg_controllen = sizeof ctl.buf;
+		struct cmsghdr *h = CMSG_FIRSTHDR(&mh);
+		h->cmsg_level = SOL_SOCKET;
+		h->cmsg_type = SCM_RIGHTS;
+		h->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(h), &fd, sizeof fd);
+	}
+	return sendmsg(sock, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/* sends as much of out as the socket takes */
+static bool
+batchFlush(struct Batch *b)
+{
+	while (b->outLen > 0)
+	{
+		size_t len = b->outLen;
+		int fd = -1;
+		if (b->nfds > 0)
+		{
+			len = b->fdEnd[0];
+			fd = b->fdSent ? -1 : b->fds[0];
+		}
+
+		ssize_t n = sendFd(b->fd, b->out, len, fd);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return true;
+		if (n == -1)
+		{
+			perror("sendmsg failed");
+			return false;
+		}
+
+		size_t sent = (size_t)n;
+		memmove(b->out, b->out + sent, b->outLen - sent);
+		b->outLen -= sent;
+		for (size_t i = 0; i < b->nfds; i++)
+			b->fdEnd[i] -= sent;
+		b->fdSent |= fd != -1;
+		if (b->nfds > 0 && b->fdEnd[0] == 0)
+		{
+			close(b->fds[0]);
+			b->nfds--;
+			memmove(b->fds, b->fds + 1, b->nfds * sizeof *b->fds);
+			memmove(b->fdEnd,
+				b->fdEnd + 1,
+				b->nfds * sizeof *b->fdEnd);
+			b->fdSent = false;
+		}
+	}
+	return true;
+}
+
+/* handles the replies that arrived, in the order of their commands */
+static bool
+batchReplies(struct Batch *b)
+{
+	while (b->n > 0)
+	{
+		unsigned char *end = b->reply + b->replyLen;
+		size_t room = sizeof b->reply - b->replyLen;
+		ssize_t n = recv(b->fd, end, room, MSG_DONTWAIT);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return true;
+		if (n <= 0)
+		{
+			fprintf(stderr, "Connection closed early\n");
+			return false;
+		}
+		b->replyLen += (size_t)n;
+
+		size_t pos = 0;
+		while (b->n > 0)
+		{
+			struct Cmd *c = &b->pending[b->head];
+			size_t want = cmdReplySize(c);
+			if (b->replyLen - pos < want)
+				break;
+			b->ok &= cmdReply(c, b->reply + pos, b->lines);
+			cmdFree(c);
+			pos += want;
+			b->head = (b->head + 1) % BATCH_PENDING;
+			b->n--;
+		}
+		memmove(b->reply, b->reply + pos, b->replyLen - pos);
+		b->replyLen -= pos;
+	}
+	return true;
+}
+
+/* splits line into words. returns the number of words or -1 if too many */
+static int
+splitWords(char *line, char **argv)
+{
+	int argc = 0;
+	for (;;)
+	{
+		line += strspn(line, " \t\r");
+		if (*line == '\0')
+			return argc;
+		if (argc == BATCH_ARGS)
+			return -1;
+		argv[argc++] = line;
+		line += strcspn(line, " \t\r");
+		if (*line != '\0')
+			*line++ = '\0';
+	}
+}
+
+static inline bool
+batchRoom(const struct Batch *b)
+{
+	size_t need = sizeof(struct Msg) + sizeof(struct MsgRect);
+	return b->outLen + need <= sizeof b->out && b->n < BATCH_PENDING &&
+	       b->nfds < BATCH_FDS;
+}
+
+/* parses & queues the complete lines read so far. a full queue leaves the
+ * rest for later. a bad line ends the batch */
+static bool
+batchLines(struct Batch *b)
+{
+	size_t pos = 0;
+	bool partial = false;
+	while (batchRoom(b))
+	{
+		char *line = b->in + pos;
+		char *nl = memchr(line, '\n', b->inLen - pos);
+		partial = nl == NULL;
+		if (partial && !(b->eof && pos < b->inLen))
+			break;
+		size_t len = nl != NULL ? (size_t)(nl - line) : b->inLen - pos;
+
+		line[len] = '\0';
+		b->line++;
+		pos += len + (nl != NULL);
+
+		char *argv[BATCH_ARGS];
+		int argc = splitWords(line, argv);
+		if (argc == 0 || (argc > 0 && argv[0][0] == '#'))
+			continue;
+
+		struct Cmd c;
+		if (argc == -1)
+			fprintf(stderr, "Too many arguments\n");
+		else if (cmdParse(&c, argc, argv, true))
+		{
+			batchPush(b, &c);
+			continue;
+		} else
+			cmdFree(&c);
+		fprintf(stderr, "Invalid command on line %zu\n", b->line);
+		return false;
+	}
+
+	memmove(b->in, b->in + pos, b->inLen - pos);
+	b->inLen -= pos;
+	if (partial && b->inLen == sizeof b->in)
+	{
+		fprintf(stderr, "Line %zu is too long\n", b->line + 1);
+		return false;
+	}
+	return true;
+}
+
+static bool
+batchRead(struct Batch *b)
+{
+	size_t room = sizeof b->in - b->inLen;
+	ssize_t n = read(STDIN_FILENO, b->in + b->inLen, room);
+	if (n == -1 && errno == EINTR)
+		return true;
+	if (n == -1)
+	{
+		perror("failed to read commands");
+		return false;
+	}
+	b->eof = n == 0;
+	b->inLen += (size_t)n;
+	return true;
+}
+
+/* sends the queued commands & the ones read from stdin, if lines is set,
+ * then waits for all replies */
+static bool
+batchRun(struct Batch *b)
+{
+	for (;;)
+	{
+		if (b->lines && !batchLines(b))
+		{
+			/* stops reading commands */
+			b->eof = true;
+			b->inLen = 0;
+			b->ok = false;
+		}
+		bool input = b->lines && !b->eof && b->inLen < sizeof b->in;
+		bool queued = b->lines && b->inLen > 0;
+		if (!input && !queued && b->outLen == 0 && b->n == 0)
+			return b->ok;
+
+		struct pollfd p[2] = {
+			{b->fd, 0, 0},
+			{STDIN_FILENO, input && batchRoom(b) ? POLLIN : 0, 0},
+		};
+		if (b->n > 0)
+			p[0].events |= POLLIN;
+		if (b->outLen > 0)
+			p[0].events |= POLLOUT;
+		if (poll(p, 2, -1) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("poll failed");
+			return false;
+		}
+
+		if (p[0].revents & POLLHUP && b->n == 0)
+		{
+			fprintf(stderr, "Connection closed early\n");
+			return false;
+		}
+		if (p[0].revents & (POLLIN | POLLHUP | POLLERR) &&
+		    !batchReplies(b))
+			return false;
+		if (p[0].revents & (POLLOUT | POLLERR) && !batchFlush(b))
+			return false;
+		if (p[1].revents & (POLLIN | POLLHUP) && !batchRead(b))
+		{
+			b->eof = true;
+			b->inLen = 0;
+			b->ok = false;
+		}
+	}
+}
+
 int
 main(int argc, char **argv)
 {
 	if (argc < 3)
 		return EXIT_FAILURE;
 
-	int fd;
-	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+	static struct Batch b;
+	b.ok = true;
+	if ((b.fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
 	{
 		perror("socket failed");
 		return EXIT_FAILURE;
@@ -82,58 +692,39 @@ main(int argc, char **argv)
 	struct sockaddr_un addr = {0};
 	addr.sun_family = AF_UNIX;
 	strcpy(addr.sun_path, argv[1]);
-	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+	if (connect(b.fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
 	{
 		perror("connect failed");
 		goto exit_fail;
 	}
 
-	if (strcmp(argv[2], "setcolor") == 0)
+	/* - reads one command per line from stdin */
+	if (strcmp(argv[2], "-") == 0)
 	{
-		if (argc != 4)
-		{
-			fprintf(stderr, "Missing color for setcolor\n");
-			goto exit_fail;
-		}
-		struct Msg m = {MSG_SET_COLOR, {0}};
-		if (!storgba(argv[3], &m.data.color))
+		if (argc != 3)
 		{
-			fprintf(stderr, "Failed to parse color %s\n", argv[3]);
+			fprintf(stderr, "Excess arguments\n");
 			goto exit_fail;
 		}
-		if (write(fd, &m, sizeof(m)) == -1)
+		b.lines = true;
+	} else
+	{
+		struct Cmd c;
+		if (!cmdParse(&c, argc - 2, argv + 2, false))
 		{
-			perror("write failed");
+			cmdFree(&c);
 			goto exit_fail;
 		}
-		goto arg_found;
+		batchPush(&b, &c);
 	}
 
-	if (strcmp(argv[2], "getcolor") == 0)
-	{
-		struct Msg m = {MSG_GET_COLOR, {0}};
-		if (write(fd, &m, sizeof(m)) == -1)
-		{
-			perror("write failed");
-			goto exit_fail;
-		}
+	if (!batchRun(&b))
+		goto exit_fail;
 
-		struct ColorRGBA color;
-		if (read(fd, &color, sizeof(color)) != sizeof(color))
-		{
-			perror("read failed");
-			goto exit_fail;
-		}
-		printf("%02x%02x%02x%02x", color.r, color.g, color.b, color.a);
-		goto arg_found;
-	}
+	close(b.fd);
+	return EXIT_SUCCESS;
 
-	fprintf(stderr, "Unknown command: %s\n", argv[2]);
 exit_fail:
-	close(fd);
+	close(b.fd);
 	return EXIT_FAILURE;
-
-arg_found:
-	close(fd);
-	return EXIT_SUCCESS;
 }
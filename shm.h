@@ -0,0 +1,74 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ * copyright 2025-2026 mannikim <mannikim[at]proton[dot]me>
+ * this file is part of pie
+ * see LICENSE file for the license text
+
+layout of the canvas pie exports to shared memory with -shm. requires struct
+ColorRGBA to be defined
+
+pie is the only writer. readers map the object read-only & check that seq was
+even & unchanged around their read, retrying otherwise:
+
+	uint32_t seq;
+	do {
+		seq = shmReadBegin(s);
+		... read s->px ...
+	} while (shmReadRetry(s, seq));
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHM_MAGIC 0x65697066 /* "fpie" in memory */
+
+struct ShmCanvas {
+	uint32_t magic;
+	/* odd while pie writes */
+	volatile uint32_t seq;
+	int32_t w, h;
+	/* bumped by every write, so readers can skip unchanged canvases */
+	volatile uint64_t gen;
+	/* w * h pixels, row by row */
+	struct ColorRGBA px[];
+};
+
+static inline size_t
+shmSize(int w, int h)
+{
+	return sizeof(struct ShmCanvas) +
+	       (size_t)w * (size_t)h * sizeof(struct ColorRGBA);
+}
+
+static inline void
+shmWriteBegin(struct ShmCanvas *s)
+{
+	s->seq++;
+	__sync_synchronize();
+}
+
+static inline void
+shmWriteEnd(struct ShmCanvas *s)
+{
+	s->gen++;
+	__sync_synchronize();
+	s->seq++;
+}
+
+/* waits out a write in progress */
+static inline uint32_t
+shmReadBegin(const struct ShmCanvas *s)
+{
+	uint32_t seq;
+	while ((seq = s->seq) & 1)
+		;
+	__sync_synchronize();
+	return seq;
+}
+
+static inline bool
+shmReadRetry(const struct ShmCanvas *s, uint32_t seq)
+{
+	__sync_synchronize();
+	return s->seq != seq;
+}